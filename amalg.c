@@ -15,7 +15,7 @@
 #include "host.c"
 #include "mp.c"
 
-#include "sql.h"
+#include "sql.c"
 
 #ifdef M3_LUADEF
 
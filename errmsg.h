@@ -2,6 +2,8 @@ ERRDEF(LSTATE,   "failed to create lua state")
 ERRDEF(LINIT,    "failed to initialize environment")
 ERRDEF(MMAP,     "failed to map virtual memory")
 ERRDEF(OOM,      "out of memory")
+ERRDEF(OPEN,     "failed to open file")
+ERRDEF(SQLIMAGE, "failed to register database image")
 #if M3_LINUX
 ERRDEF(FORK,     "fork failed")
 ERRDEF(UNSHARE,  "unshare failed")
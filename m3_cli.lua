@@ -12,9 +12,33 @@ local function help(progname)
   -j cmd      Perform LuaJIT control command (in worker states).
   -O[opt]     Control LuaJIT optimizations (in worker states).
   -p num      Control parallelization.
+  -w num      Run `num' tasks before forking workers to warm up the JIT compiler.
+              Only applies to fork pools.
+  -b num      Send tasks to workers in batches of `num', prefetching their input rows.
+  -k num      Like -b, but run each task's program as a plain list of calls instead of
+              through the control stack. Tasks still run one at a time, each reloading the
+              initial state, reading its input and committing on its own. Only the control
+              stack overhead is removed. The program must not branch.
+  -m          Share the main database between workers as a read-only in-memory image.
+              Output must go to attached database files. String DDL only runs in the
+              main process, so connection settings such as PRAGMAs don't reach workers.
+  -r          Send key ranges of the task query to workers instead of tasks, and let
+              workers read their own input rows.
+  -i path     Serve task input rows from the input snapshot `path' (see -S).
+  -S path     Write the script's keyed input tables to the input snapshot `path' and exit.
+              Only the tables read by the first task are included, the rest of the input
+              is still read from the database.
+  -c dir      Cache the bytecode of generated code in `dir'.
+  -o mode     Output mode for parallel runs: `writer' (single writer process),
+              `shard' or `shard:col' (per-worker databases, merged in order of `col').
   -V          Show version.
   -v[flags]   Verbose output.
   -q          Disable progress indicator (quiet).
+  -D path     Run as a daemon, serving task queries on the unix socket `path'.
+              The daemon reloads when the script, its included files or any lua module
+              it required from package.path changes. C modules are not tracked.
+              An existing file at `path' is only replaced if it is a socket.
+  -C path     Submit a task query to the daemon at `path' and wait for it to finish.
   -t          Run in test mode.
   -T          Run in test mode, stop handling options, and treat arguments as additional scripts.
   --          Stop handling options.
@@ -28,8 +52,30 @@ local function version()
 	print("sqlite " .. require("m3.sqlite").version())
 end
 
-local function eval_quiet(pool, task)
-	return function(...) return pool:eval(task.simulate, ...) end
+-- returns push(...), finish().
+-- push collects task rows and calls submit(rows) for every `num` rows, finish submits the rest.
+local function batcher(num, submit)
+	local rows = {}
+	local function finish()
+		if #rows > 0 then
+			local batch = rows
+			rows = {}
+			submit(batch)
+		end
+	end
+	return function(...)
+		table.insert(rows, {n=select("#", ...), ...})
+		if #rows >= num then finish() end
+	end, finish
+end
+
+local function nop() end
+
+local function eval_quiet(pool, task, batch)
+	if batch then
+		return batcher(batch, function(rows) pool:eval(task.batch, rows) end)
+	end
+	return function(...) return pool:eval(task.simulate, ...) end, nop
 end
 
 local function updateprogress(submitted, completed, total)
@@ -46,21 +92,25 @@ local function updateprogress(submitted, completed, total)
 	io.stderr:flush()
 end
 
-local function eval_progress(pool, task, con)
+local function eval_progress(pool, task, con, batch)
 	local query = { sqlite.sql("SELECT", "COUNT(*)"), sqlite.sql("FROM", task.query) }
 	local count = con:row(query)[1]
 	if count == 1 then
-		return eval_quiet(pool, task)
+		return eval_quiet(pool, task, batch)
 	end
 	local submitted, completed = 0, 0
-	return function(...)
-		submitted = submitted+1
+	local function submit(num, func, ...)
+		submitted = submitted+num
 		updateprogress(submitted, completed, count)
-		return pool:eval(task.simulate, ...):oncomplete(function()
-			completed = completed+1
+		return pool:eval(func, ...):oncomplete(function()
+			completed = completed+num
 			updateprogress(submitted, completed, count)
 		end)
 	end
+	if batch then
+		return batcher(batch, function(rows) submit(#rows, task.batch, rows) end)
+	end
+	return function(...) return submit(1, task.simulate, ...) end, nop
 end
 
 local function isatty(fd)
@@ -104,6 +154,10 @@ for _,a in ipairs(actions) do
 		error("TODO")
 	elseif o == "v" then
 		m3.settrace(v == "" and true or v)
+	elseif o == "i" then
+		m3.snapshot_use(v)
+	elseif o == "c" then
+		m3.code_cache(v)
 	end
 end
 		]], args.actions)
@@ -151,35 +205,193 @@ local function xunpack(t, i)
 	local v = t[i]
 	if v then return v, xunpack(t, i+1) end
 end
+if ... then
+	local steps, bad = m3.flatten(insn)
+	if not steps then
+		error(string.format("-k needs a program without branching, but `%s' branches", bad))
+	end
+	local nstep = #steps
+	return function(...)
+		control_load(fp)
+		init(...)
+		for i=1, nstep do
+			local r = steps[i]()
+			if r ~= nil then return r end
+		end
+	end
+end
 return function(...)
 	control_load(fp)
 	init(...)
 	control_exec(insn)
 end
-	]])
+	]], args.lockstep or false)
+	local batch = env:func([[
+local eval, prefetch, unpack = m3.eval, m3.prefetch, unpack
+local simulate = ...
+return function(rows)
+	prefetch(rows)
+	for i=1, #rows do
+		eval(simulate, unpack(rows[i], 1, rows[i].n))
+	end
+	prefetch()
+end
+	]], simulate)
+	local range = env:func([[
+local C = require "m3_C"
+local eval, prefetch, statement, unpack = m3.eval, m3.prefetch, m3.statement, unpack
+local simulate = ...
+return function(sql, lo, hi)
+	local t = C.m3_sys_time_ns()
+	local s = statement(sql).sqlite3_stmt
+	s:bindargs(lo, hi)
+	local rows, ncol = {}, s:colcount()
+	while s:step() do
+		local row = {n=ncol}
+		for i=1, ncol do row[i] = s:col(i-1) end
+		table.insert(rows, row)
+	end
+	s:reset()
+	prefetch(rows)
+	for i=1, #rows do
+		eval(simulate, unpack(rows[i], 1, ncol))
+	end
+	prefetch()
+	return #rows, tonumber(C.m3_sys_time_ns()-t)/1e9
+end
+	]], simulate)
 	return {
 		query    = query,
 		url      = url,
 		ddl      = ddl,
-		simulate = simulate
+		simulate = simulate,
+		batch    = batch,
+		range    = range
 	}
 end
 
+-- run the first `num` tasks in the host state. the pool throws away their results.
+local function warmup(num)
+	return function(env, task)
+		local con = sqlite.open(task.url):gc()
+		con:execscript(task.ddl)
+		local n = 0
+		for row in con:rows(task.query) do
+			if n >= num then break end
+			env:eval(task.simulate, row:unpack())
+			n = n+1
+		end
+		con:close()
+	end
+end
+
+local function poolconfig(args)
+	local config = { mode=args.mode }
+	if args.warmup and args.warmup > 0 then
+		config.warmup = warmup(args.warmup)
+	end
+	config.image = args.image_db
+	if args.output == "writer" then
+		config.writer = true
+	elseif args.output and args.output:match("^shard") then
+		config.shard = args.output:match("^shard:(.+)$") or true
+	end
+	return config
+end
+
+-- range dispatch: split the task query into half-open ranges of its first column, and have the
+-- workers run the query over their range. ranges are sized to take about RANGE_TIME seconds
+-- each, based on the timings reported by the workers, and shrink towards the end of the key
+-- space so that the workers finish together.
+local RANGE_TIME = 0.05
+local RANGE_ROWS = 64
+
+-- returns false if the task query has no numeric first column to split on.
+-- the ranges only match numeric keys, so any NULL or text key means there is none.
+local function dispatch_ranges(pool, task, con, progress)
+	local stmt = con:prepare(task.query)
+	local key = sqlite.escape(stmt:name(0))
+	stmt:finalize()
+	local min, max, count, numeric = unpack(con:row(string.format(
+		"SELECT MIN(%s), MAX(%s), COUNT(*), TOTAL(typeof(%s) IN ('integer', 'real')) FROM (%s)",
+		key, key, key, task.query)))
+	if count == 0 then
+		return true
+	end
+	if type(min) ~= "number" or type(max) ~= "number" or numeric ~= count then
+		return false
+	end
+	local sql = string.format("SELECT * FROM (%s) WHERE %s >= ?1 AND %s < ?2",
+		task.query, key, key)
+	local span = max-min+1
+	local density = count/span
+	local parallel = pool.parallel or 1
+	local completed, spr = 0, nil
+	local lo = min
+	while lo < min+span do
+		local rows = spr and RANGE_TIME/spr or RANGE_ROWS
+		rows = math.max(1, math.min(rows, (min+span-lo)*density/(2*parallel)))
+		local hi = math.min(lo + rows/density, min+span)
+		pool:eval(task.range, sql, lo, hi):oncomplete(function(n, dt)
+			completed = completed+n
+			if n > 0 then
+				spr = spr and 0.8*spr+0.2*dt/n or dt/n
+			end
+			if progress then progress(math.floor((hi-min)*density), completed, count) end
+		end)
+		lo = hi
+	end
+	return true
+end
+
 local function driver_simulate(args)
-	local pool, task = m3.pool(function(env) return init(env, args) end, args.mode)
+	local config = poolconfig(args)
+	local pool, task = m3.pool(function(env) return init(env, args) end, config)
 	local con = sqlite.open(task.url):gc()
 	con:execscript(task.ddl)
-	local eval = (args.quiet or not isatty(2))
-		and eval_quiet(pool, task)
-		or eval_progress(pool, task, con)
+	if args.range then
+		local progress = not (args.quiet or not isatty(2)) and updateprogress
+		if dispatch_ranges(pool, task, con, progress) then
+			m3.wait(pool)
+			pool:close()
+			con:close()
+			return
+		end
+	end
+	local eval, finish
+	if args.quiet or not isatty(2) then
+		eval, finish = eval_quiet(pool, task, args.batch)
+	else
+		eval, finish = eval_progress(pool, task, con, args.batch)
+	end
 	for row in con:rows(task.query) do
 		eval(row:unpack())
 	end
+	finish()
 	m3.wait(pool)
 	pool:close()
 	con:close()
 end
 
+-- input queries are only compiled when a task runs, so run the first task (and throw away
+-- its output) before writing the snapshot. inputs that the first task doesn't read are not
+-- in the snapshot, and tasks that read them go to the database as usual.
+local function driver_snapshot(args)
+	local env = m3.new()
+	local task = init(env, args)
+	local con = sqlite.open(task.url):gc()
+	con:execscript(task.ddl)
+	env:eval("m3.warmup(true)")
+	for row in con:rows(task.query) do
+		env:eval(task.simulate, row:unpack())
+		break
+	end
+	env:eval("m3.warmup(false)")
+	con:close()
+	env:eval("m3.snapshot_write(...)", args.snapshot)
+	env:close()
+end
+
 local function test_open(env)
 	env:eval([[
 test = {}
@@ -239,6 +451,299 @@ local function driver_test(args)
 	end
 end
 
+---- Daemon --------------------------------------------------------------------
+
+-- the daemon keeps an initialized pool resident and runs task queries submitted over a unix
+-- socket. the protocol is line based:
+--   client -> daemon:   "<n>\n" followed by the n byte task query (empty for the script's
+--                       default). a client that doesn't send it within DAEMON_TIMEOUT
+--                       seconds is dropped.
+--   daemon -> client:   "ok <i>" for each completed task,
+--                       "error <message>" (message lines prefixed with "\t"),
+--                       "done <completed> <total>" when finished.
+
+local sock_cdef = false
+local DAEMON_TIMEOUT = 10
+
+local function sock_init()
+	if jit.os == "Windows" then
+		error("daemon mode is not supported on Windows")
+	end
+	if not sock_cdef then
+		ffi.cdef [[
+			struct m3_sockaddr_un { unsigned short sun_family; char sun_path[108]; };
+			int socket(int, int, int);
+			int bind(int, const void *, unsigned);
+			int listen(int, int);
+			int accept(int, void *, void *);
+			int connect(int, const void *, unsigned);
+			int shutdown(int, int);
+			int setsockopt(int, int, int, const void *, unsigned);
+			intptr_t read(int, void *, size_t);
+			intptr_t write(int, const void *, size_t);
+			int close(int);
+			int unlink(const char *);
+			void *signal(int, void *);
+			char *strerror(int);
+		]]
+		sock_cdef = true
+	end
+end
+
+local function sock_check(r, what)
+	if r < 0 then
+		error(string.format("%s: %s", what, ffi.string(ffi.C.strerror(ffi.errno()))), 2)
+	end
+	return r
+end
+
+local function sock_addr(path)
+	local addr = ffi.new("struct m3_sockaddr_un")
+	if #path >= ffi.sizeof(addr.sun_path) then
+		error(string.format("socket path too long: `%s'", path))
+	end
+	addr.sun_family = 1 -- AF_UNIX
+	ffi.copy(addr.sun_path, path)
+	return addr
+end
+
+local function sock_new()
+	return sock_check(ffi.C.socket(1, 1, 0), "socket") -- AF_UNIX, SOCK_STREAM
+end
+
+local function sock_listen(path)
+	sock_init()
+	local addr = sock_addr(path)
+	local fd = sock_new()
+	-- remove stale socket from a previous run, but never anything else.
+	local kind = m3.issocket(path)
+	if kind == 0 then
+		error(string.format("refusing to replace `%s': not a socket", path))
+	elseif kind == 1 then
+		ffi.C.unlink(path)
+	end
+	sock_check(ffi.C.bind(fd, addr, ffi.sizeof(addr)), "bind")
+	sock_check(ffi.C.listen(fd, 16), "listen")
+	return fd
+end
+
+local function sock_connect(path)
+	sock_init()
+	local addr = sock_addr(path)
+	local fd = sock_new()
+	sock_check(ffi.C.connect(fd, addr, ffi.sizeof(addr)), "connect")
+	return fd
+end
+
+local function sock_send(fd, s)
+	local ptr = ffi.cast("const char *", s)
+	local len = #s
+	while len > 0 do
+		local r = tonumber(ffi.C.write(fd, ptr, len))
+		if r < 0 then
+			-- client went away, nothing we can do about it.
+			return false
+		end
+		ptr, len = ptr+r, len-r
+	end
+	return true
+end
+
+-- reads fail after `sec' seconds without data.
+local function sock_timeout(fd, sec)
+	local level, opt = 1, 20 -- SOL_SOCKET, SO_RCVTIMEO
+	if jit.os == "OSX" or jit.os == "BSD" then level, opt = 0xffff, 0x1006 end
+	local tv = ffi.new("long[2]", sec, 0) -- struct timeval
+	sock_check(ffi.C.setsockopt(fd, level, opt, tv, ffi.sizeof(tv)), "setsockopt")
+end
+
+-- read a request: its length on a line of its own, then the request itself.
+local function sock_request(fd)
+	local buf = ffi.new("char[4096]")
+	local data, len = "", nil
+	while true do
+		if not len then
+			local nl = data:find("\n", 1, true)
+			if nl then
+				len = tonumber(data:sub(1, nl-1))
+				if not len then error("malformed request") end
+				data = data:sub(nl+1)
+			end
+		end
+		if len and #data >= len then
+			return data:sub(1, len)
+		end
+		local r = tonumber(sock_check(ffi.C.read(fd, buf, 4096), "read"))
+		if r == 0 then error("connection closed before the end of the request") end
+		data = data .. ffi.string(buf, r)
+	end
+end
+
+local function sock_lines(fd)
+	local pending = ""
+	local buf = ffi.new("char[4096]")
+	return function()
+		while true do
+			local nl = pending:find("\n", 1, true)
+			if nl then
+				local line = pending:sub(1, nl-1)
+				pending = pending:sub(nl+1)
+				return line
+			end
+			local r = tonumber(sock_check(ffi.C.read(fd, buf, 4096), "read"))
+			if r == 0 then return end
+			pending = pending .. ffi.string(buf, r)
+		end
+	end
+end
+
+local function readfile(name)
+	local fp = io.open(name, "rb")
+	if not fp then return false end
+	local s = fp:read("*a")
+	fp:close()
+	return s
+end
+
+local function daemon_start(args)
+	local sources
+	local pool, task = m3.pool(function(env)
+		local task = init(env, args)
+		-- included files and every lua module that came from package.path.
+		sources = env:eval([[
+local sources = m3.sources()
+for name in pairs(package.loaded) do
+	local path = package.searchpath(name, package.path)
+	if path then table.insert(sources, path) end
+end
+return sources
+		]])
+		return task
+	end, poolconfig(args))
+	table.insert(sources, args.script)
+	local files = {}
+	for _,name in ipairs(sources) do
+		files[name] = readfile(name)
+	end
+	return { pool=pool, task=task, files=files }
+end
+
+local function daemon_stop(state)
+	pcall(state.pool.close, state.pool)
+end
+
+local function daemon_changed(state)
+	for name,contents in pairs(state.files) do
+		if readfile(name) ~= contents then
+			return true
+		end
+	end
+	return false
+end
+
+local function daemon_senderror(fd, err)
+	sock_send(fd, "error " .. tostring(err):gsub("\n", "\n\t") .. "\n")
+end
+
+local function daemon_serve(state, fd, query)
+	local pool, task = state.pool, state.task
+	if query == "" then query = task.query end
+	local con = sqlite.open(task.url):gc()
+	con:execscript(task.ddl)
+	local total, completed = 0, 0
+	local ok, err = pcall(function()
+		for row in con:rows(query) do
+			total = total+1
+			local i = total
+			pool:eval(task.simulate, row:unpack()):oncomplete(function()
+				completed = completed+1
+				sock_send(fd, string.format("ok %d\n", i))
+			end)
+		end
+		m3.wait(pool)
+	end)
+	con:close()
+	if not ok then daemon_senderror(fd, err) end
+	sock_send(fd, string.format("done %d %d\n", completed, total))
+	-- a failed task leaves the pool in an error state, so start over on the next request.
+	return ok
+end
+
+-- serve one request, returns the new state.
+local function daemon_request(args, state, fd, query)
+	if state and daemon_changed(state) then
+		io.stderr:write("m3: sources changed, reloading\n")
+		daemon_stop(state)
+		state = nil
+	end
+	if not state then
+		local ok, s = xpcall(daemon_start, debug.traceback, args)
+		if ok then
+			state = s
+		else
+			daemon_senderror(fd, s)
+			sock_send(fd, "done 0 0\n")
+		end
+	end
+	if state and not daemon_serve(state, fd, query) then
+		daemon_stop(state)
+		state = nil
+	end
+	return state
+end
+
+local function driver_daemon(args)
+	-- writing to a client that went away must fail instead of killing us.
+	sock_init()
+	ffi.C.signal(13, ffi.cast("void *", 1)) -- SIGPIPE, SIG_IGN
+	local listen = sock_listen(args.daemon)
+	local state = daemon_start(args)
+	io.stderr:write("m3: listening on ", args.daemon, "\n")
+	while true do
+		local fd = ffi.C.accept(listen, nil, nil)
+		if fd >= 0 then
+			-- a client that stalls or goes away only loses its own request.
+			local ok, query = pcall(function()
+				sock_timeout(fd, DAEMON_TIMEOUT)
+				return sock_request(fd)
+			end)
+			if not ok then
+				io.stderr:write("m3: dropped request: ", tostring(query), "\n")
+			else
+				local prev = state
+				ok, state = pcall(daemon_request, args, state, fd, query)
+				if not ok then
+					io.stderr:write("m3: ", tostring(state), "\n")
+					if prev then daemon_stop(prev) end
+					state = nil
+				end
+			end
+			ffi.C.close(fd)
+		end
+	end
+end
+
+local function driver_client(args)
+	local fd = sock_connect(args.client)
+	local query = args.query or ""
+	sock_send(fd, string.format("%d\n%s", #query, query))
+	ffi.C.shutdown(fd, 1) -- SHUT_WR
+	local status = 1
+	for line in sock_lines(fd) do
+		local completed, total = line:match("^done (%d+) (%d+)$")
+		if completed then
+			io.stderr:write(string.format("%s / %s tasks completed\n", completed, total))
+			if completed == total then status = 0 end
+		elseif line:sub(1,6) == "error " then
+			io.stderr:write(line:sub(7), "\n")
+		elseif line:sub(1,1) == "\t" then
+			io.stderr:write(line:sub(2), "\n")
+		end
+	end
+	ffi.C.close(fd)
+	return status
+end
+
 local function parseargs(progname, ...)
 	local n = select("#", ...)
 	local args = {...}
@@ -256,7 +761,8 @@ local function parseargs(progname, ...)
 			break
 		elseif f == "V" then
 			return version()
-		elseif f == "p" or f == "j" or f == "s" then
+		elseif f == "p" or f == "j" or f == "s" or f == "w" or f == "b" or f == "D" or f == "C"
+			or f == "o" or f == "i" or f == "S" or f == "c" or f == "k" then
 			if #a == 2 then
 				i = i+1
 				if i > n then return help(progname) end
@@ -266,6 +772,25 @@ local function parseargs(progname, ...)
 			end
 			if f == "p" then
 				ret.mode = a
+			elseif f == "D" then
+				ret.daemon = a
+				ret.driver = driver_daemon
+			elseif f == "C" then
+				ret.client = a
+				ret.driver = driver_client
+			elseif f == "S" then
+				ret.snapshot = a
+				ret.driver = driver_snapshot
+			elseif f == "o" then
+				if a ~= "writer" and not a:match("^shard") then return help(progname) end
+				ret.output = a
+			elseif f == "w" then
+				ret.warmup = tonumber(a)
+				if not ret.warmup then return help(progname) end
+			elseif f == "b" or f == "k" then
+				ret.batch = tonumber(a)
+				ret.lockstep = f == "k"
+				if not ret.batch or ret.batch < 1 then return help(progname) end
 			elseif f == "s" then
 				if not ret.image then
 					ret.image = a
@@ -279,6 +804,10 @@ local function parseargs(progname, ...)
 			table.insert(ret.actions, {o=f, v=a:sub(3)})
 		elseif f == "q" then
 			ret.quiet = true
+		elseif f == "r" then
+			ret.range = true
+		elseif f == "m" then
+			ret.image_db = true
 		elseif f == "t" then
 			ret.driver = driver_test
 		elseif f == "T" then
@@ -291,6 +820,10 @@ local function parseargs(progname, ...)
 		end
 		i = i+1
 	end
+	if ret.client then
+		ret.query = args[i]
+		return ret
+	end
 	if i > n then return help(progname) end
 	ret.script = args[i]
 	ret.args = {unpack(args, i+1)}
@@ -1,6 +1,11 @@
+local C = require "m3_C"
 local buffer = require "string.buffer"
+local ffi = require "ffi"
 local event = require("m3_debug").event
 
+local cache_dir -- bytecode cache, see cache()
+local cache_tmp = 0 -- temporary file counter
+
 local function embedconst(x)
 	if type(x) == "string" then
 		return string.format("%q", x)
@@ -82,12 +87,70 @@ local function setupvalue(f, up, v)
 	debug.setupvalue(f, upvalueidx(f, up), v)
 end
 
+-- FNV-1a over 64-bit words, for cache file names only.
+local function hash(s)
+	local n = #s
+	local p = ffi.cast("const uint8_t *", s)
+	local w = ffi.cast("const uint64_t *", p)
+	local h = 0xcbf29ce484222325ull
+	local nw = bit.rshift(n, 3)
+	for i=0, nw-1 do
+		h = bit.bxor(h, w[i]) * 0x100000001b3ull
+	end
+	for i=8*nw, n-1 do
+		h = bit.bxor(h, p[i]) * 0x100000001b3ull
+	end
+	return h
+end
+
+-- cached chunks are keyed by their source, so a changed model or script simply misses.
+-- the file holds the source next to the bytecode, and a hash collision is a miss, too.
+-- only the parse is cached: the upvalues are passed in when the chunk runs, and they
+-- point to objects of the current process.
+local function loadcached(src, name)
+	src = tostring(src)
+	local path = string.format("%s/%s.bc", cache_dir, bit.tohex(hash(src)))
+	local fp = io.open(path, "rb")
+	if fp then
+		local ok, c = pcall(buffer.decode, fp:read("*a"))
+		fp:close()
+		if ok and type(c) == "table" and c.src == src and c.name == name then
+			local f = load(c.bc, name, "b")
+			if f then return f end
+		end
+	end
+	local f = assert(load(src, name))
+	-- write to a temporary file of our own and rename, so that no process ever sees a partial
+	-- or interleaved chunk.
+	cache_tmp = cache_tmp+1
+	local tmp = string.format("%s.%d.%d", path, C.m3_sys_getpid(), cache_tmp)
+	fp = io.open(tmp, "wb")
+	if fp then
+		local ok = fp:write(buffer.encode({src=src, name=name, bc=string.dump(f)}))
+		ok = fp:close() and ok
+		if ok then
+			os.rename(tmp, path)
+		else
+			os.remove(tmp)
+		end
+	end
+	return f
+end
+
 -- TODO: add descriptive chunk names for each call
 local function loadcode(...)
 	event("code", ...)
+	if cache_dir then
+		return loadcached(...)
+	end
 	return assert(load(...))
 end
 
+-- cache(dir): cache the bytecode of generated code in `dir', which must exist.
+local function cache(dir)
+	cache_dir = dir
+end
+
 local function chunkname(s)
 	return string.format("=m3: %s", s)
 end
@@ -99,5 +162,6 @@ return {
 	new          = new,
 	setupvalue   = setupvalue,
 	load         = loadcode,
+	cache        = cache,
 	chunkname    = chunkname
 }
@@ -0,0 +1,359 @@
+local ffi = require "ffi"
+local buffer = require "string.buffer"
+local cast = ffi.cast
+
+-- column files are an append-only output format for large runs, where the sqlite write
+-- throughput would otherwise limit the simulation. each process writes its own file
+-- (`path.<worker id>' in workers), and the files can be loaded into sqlite afterwards with
+-- tosqlite().
+--
+-- file layout:
+--   [0]      "m3cols01"
+--   blocks, each aligned to 8 bytes:
+--     uint32_t kind, uint32_t header length, uint64_t data length
+--     header (string.buffer encoded), padded to 8 bytes
+--     data
+-- block kinds:
+--   TABLE    { id=..., name=..., cols={ {name=..., ctype=...}, ... } }
+--   DICT     { tab=id, col=j, values={...} }  values appended to the dictionary of column j
+--   ROWS     { tab=id, nrow=... }
+--            data: for each column, nrow values (uint32_t codes for dictionary columns),
+--            padded to 8 bytes.
+-- ctype is either a C type name, or "dict" for a dictionary encoded column: codes are 0-based
+-- indices into the values of all DICT blocks for the column, in file order, and NULL_CODE is nil.
+-- a truncated block at the end of the file is ignored.
+
+local MAGIC = "m3cols01"
+local BLOCK_TABLE = 1
+local BLOCK_DICT  = 2
+local BLOCK_ROWS  = 3
+local BLOCK_ROWCOUNT = 4096
+local NULL_CODE = 0xffffffff
+
+local global_path -- output path, see output()
+local global_fp
+local global_discard = false
+local writers = {} -- name -> writer
+local order = {}   -- definition order
+
+local function align8(n)
+	return bit.band(n+7, -8)
+end
+
+local function filepath()
+	if M3_WORKER_ID then
+		return string.format("%s.%d", global_path, M3_WORKER_ID)
+	else
+		return global_path
+	end
+end
+
+local function block(fp, kind, header, data, size)
+	local hdr = buffer.encode(header)
+	local hlen = #hdr
+	size = size or 0
+	-- a failed write would leave a truncated block, which read() silently drops.
+	assert(fp:write(
+		ffi.string(ffi.new("uint32_t[2]", kind, hlen), 8),
+		ffi.string(ffi.new("uint64_t[1]", size), 8),
+		hdr,
+		string.rep("\0", align8(hlen)-hlen)
+	))
+	if data then assert(fp:write(tostring(data))) end
+end
+
+local function file()
+	if not global_fp then
+		if not global_path then
+			error("column output file not set, see data.colfile()")
+		end
+		global_fp = assert(io.open(filepath(), "wb"))
+		assert(global_fp:write(MAGIC))
+	end
+	return global_fp
+end
+
+---- Writers -------------------------------------------------------------------
+
+local function writer_grow(w)
+	local cap = math.max(2*w.cap, 64)
+	for j,c in ipairs(w.cols) do
+		local data = ffi.new(c.vla, cap)
+		if w.num > 0 then
+			ffi.copy(data, w.data[j], w.num*c.size)
+		end
+		w.data[j] = data
+	end
+	w.cap = cap
+end
+
+local function writer_flush(w)
+	local fp = file()
+	if not w.defined then
+		local cols = {}
+		for j,c in ipairs(w.cols) do cols[j] = {name=c.name, ctype=c.ctype} end
+		block(fp, BLOCK_TABLE, {id=w.id, name=w.name, cols=cols})
+		w.defined = true
+	end
+	for j,c in ipairs(w.cols) do
+		if c.dict and #c.new > 0 then
+			block(fp, BLOCK_DICT, {tab=w.id, col=j, values=c.new})
+			c.new = {}
+		end
+	end
+	local num = w.num
+	if num == 0 then return end
+	local buf = buffer.new()
+	for j,c in ipairs(w.cols) do
+		local size = num*c.size
+		buf:putcdata(w.data[j], size)
+		buf:put(string.rep("\0", align8(size)-size))
+	end
+	block(fp, BLOCK_ROWS, {tab=w.id, nrow=num}, buf, #buf)
+	w.num = 0
+end
+
+-- returns the dictionary code of `v`.
+local function writer_intern(c, v)
+	if v == nil then return NULL_CODE end
+	local code = c.codes[v]
+	if not code then
+		code = c.ndict
+		c.ndict = code+1
+		c.codes[v] = code
+		table.insert(c.new, v)
+	end
+	return code
+end
+
+local function writer_func(w)
+	local buf = buffer.new()
+	buf:put("local w, grow, flush, intern, BLOCK_ROWCOUNT = ...\n")
+	buf:put("local cols = w.cols\n")
+	buf:put("return function(")
+	for j=1, #w.cols do
+		if j>1 then buf:put(",") end
+		buf:putf("x%d", j)
+	end
+	buf:put(")\nif w.discard then return end\n")
+	buf:put("local n = w.num\nif n >= w.cap then grow(w) end\nlocal data = w.data\n")
+	for j,c in ipairs(w.cols) do
+		if c.dict then
+			buf:putf("data[%d][n] = intern(cols[%d], x%d)\n", j, j, j)
+		else
+			buf:putf("data[%d][n] = x%d\n", j, j)
+		end
+	end
+	buf:put("n = n+1\nw.num = n\nif n >= BLOCK_ROWCOUNT then flush(w) end\nend\n")
+	return load(buf, string.format("=colfile(%s)", w.name))(w, writer_grow, writer_flush,
+		writer_intern, BLOCK_ROWCOUNT)
+end
+
+local function coltype(ctype)
+	if ctype == "dict" then
+		return { ctype="dict", dict=true, vla=ffi.typeof("uint32_t[?]"), size=4,
+			codes={}, new={}, ndict=0 }
+	end
+	local ct = ffi.typeof(ctype)
+	return { ctype=ctype, vla=ffi.typeof("$[?]", ct), size=ffi.sizeof(ct) }
+end
+
+-- writer(name, cols, types) -> function(...) appending a row
+-- cols is a list of column names, and types an optional table of column name -> C type name
+-- or "dict". columns without a type are doubles.
+local function writer(name, cols, types)
+	local w = writers[name]
+	if w then
+		local same = #w.cols == #cols
+		for j,c in ipairs(w.cols) do
+			same = same and c.name == cols[j] and c.ctype == ((types and types[c.name]) or "double")
+		end
+		if not same then
+			error(string.format("column table `%s' redefined with a different schema", name))
+		end
+		return w.append
+	end
+	w = {
+		id   = #order+1,
+		name = name,
+		cols = {},
+		data = {},
+		num  = 0,
+		cap  = 0,
+		discard = global_discard
+	}
+	for j,col in ipairs(cols) do
+		w.cols[j] = coltype((types and types[col]) or "double")
+		w.cols[j].name = col
+	end
+	w.append = writer_func(w)
+	writers[name] = w
+	table.insert(order, w)
+	return w.append
+end
+
+-- output(path): set the output file. workers write to `path.<worker id>'.
+local function output(path)
+	global_path = path
+end
+
+-- write all buffered rows. the file is only created when there is something to write.
+local function flush()
+	for _,w in ipairs(order) do
+		if w.num > 0 then writer_flush(w) end
+	end
+	if global_fp then assert(global_fp:flush()) end
+end
+
+-- flush and close the file. the next write starts a new file, with fresh dictionaries.
+-- raises an error if any of the rows couldn't be written.
+local function close()
+	local ok, err = pcall(flush)
+	if global_fp then
+		local cok, cerr = global_fp:close()
+		if ok and not cok then ok, err = false, cerr end
+		global_fp = nil
+		for _,w in ipairs(order) do
+			-- after a failed write the buffered rows are lost, and the error says so.
+			w.num = 0
+			w.defined = false
+			for _,c in ipairs(w.cols) do
+				if c.dict then
+					c.codes, c.new, c.ndict = {}, {}, 0
+				end
+			end
+		end
+	end
+	if not ok then error(err, 0) end
+end
+
+-- discard(true):  start dropping rows instead of writing them.
+-- discard(false): drop anything buffered so far and resume writing.
+local function discard(flag)
+	global_discard = flag
+	for _,w in ipairs(order) do
+		w.num = 0
+		w.discard = flag
+	end
+end
+
+---- Reader --------------------------------------------------------------------
+
+-- read(path) -> { [name] = { name=..., nrow=..., cols={ {name=..., ctype=..., dict={...}}, ... },
+--                            data={ ctype array, ... } } }
+-- dictionary columns hold 0-based codes into `dict`.
+local function read(path)
+	local fp = assert(io.open(path, "rb"))
+	local s = fp:read("*a")
+	fp:close()
+	if s:sub(1, #MAGIC) ~= MAGIC then
+		error(string.format("not a column file: `%s'", path))
+	end
+	local base = cast("const uint8_t *", s)
+	local ofs = #MAGIC
+	local byid, tables = {}, {}
+	while ofs+16 <= #s do
+		local kh = cast("const uint32_t *", base+ofs)
+		local kind, hlen = kh[0], kh[1]
+		local dlen = tonumber(cast("const uint64_t *", base+ofs+8)[0])
+		local data = ofs+16+align8(hlen)
+		if data+dlen > #s then break end
+		local h = buffer.decode(ffi.string(base+ofs+16, hlen))
+		if kind == BLOCK_TABLE then
+			local t = { name=h.name, nrow=0, cols=h.cols, chunks={} }
+			for _,c in ipairs(t.cols) do
+				if c.ctype == "dict" then c.dict = {} end
+			end
+			byid[h.id] = t
+			tables[h.name] = t
+		elseif kind == BLOCK_DICT then
+			local dict = byid[h.tab].cols[h.col].dict
+			for _,v in ipairs(h.values) do table.insert(dict, v) end
+		elseif kind == BLOCK_ROWS then
+			local t = byid[h.tab]
+			table.insert(t.chunks, {ofs=data, nrow=h.nrow})
+			t.nrow = t.nrow + h.nrow
+		end
+		ofs = data+dlen
+	end
+	for _,t in pairs(tables) do
+		local sizes = {}
+		t.data = {}
+		for j,c in ipairs(t.cols) do
+			local ct = ffi.typeof(c.ctype == "dict" and "uint32_t" or c.ctype)
+			sizes[j] = ffi.sizeof(ct)
+			t.data[j] = ffi.new(ffi.typeof("$[?]", ct), t.nrow)
+		end
+		local row = 0
+		for _,chunk in ipairs(t.chunks) do
+			local p = chunk.ofs
+			for j=1, #t.cols do
+				local size = chunk.nrow*sizes[j]
+				ffi.copy(cast("uint8_t *", t.data[j]) + row*sizes[j], base+p, size)
+				p = p + align8(size)
+			end
+			row = row + chunk.nrow
+		end
+		t.chunks = nil
+	end
+	return tables
+end
+
+local function sqltype(ctype)
+	if ctype == "dict" then return "" end
+	local ct = ffi.typeof(ctype)
+	if ct == ffi.typeof("float") or ct == ffi.typeof("double") then return " REAL" end
+	return " INTEGER"
+end
+
+-- tosqlite(con, paths): load column files into a sqlite connection, creating tables as needed.
+-- paths is a file name or a list of file names.
+local function tosqlite(con, paths)
+	if type(paths) == "string" then paths = {paths} end
+	for _,path in ipairs(paths) do
+		for name,t in pairs(read(path)) do
+			local ddl, cols, params = buffer.new(), {}, {}
+			ddl:putf("CREATE TABLE IF NOT EXISTS %s(", name)
+			for j,c in ipairs(t.cols) do
+				ddl:put(j>1 and ", " or "", c.name, sqltype(c.ctype))
+				cols[j] = c.name
+				params[j] = "?"
+			end
+			ddl:put(")")
+			con:execscript(tostring(ddl))
+			local stmt = con:prepare(string.format("INSERT INTO %s(%s) VALUES (%s)",
+				name, table.concat(cols, ", "), table.concat(params, ", ")))
+			local ncol = #t.cols
+			local row = {}
+			con:execscript("BEGIN")
+			for i=0, t.nrow-1 do
+				for j,c in ipairs(t.cols) do
+					local v = t.data[j][i]
+					if c.dict then
+						v = c.dict[v+1]
+					elseif type(v) == "boolean" then
+						v = v and 1 or 0
+					else
+						v = tonumber(v)
+					end
+					row[j] = v
+				end
+				stmt:bindargs(unpack(row, 1, ncol))
+				stmt:step()
+				stmt:reset()
+			end
+			con:execscript("COMMIT")
+			stmt:finalize()
+		end
+	end
+end
+
+return {
+	writer   = writer,
+	output   = output,
+	flush    = flush,
+	close    = close,
+	discard  = discard,
+	read     = read,
+	tosqlite = tosqlite
+}
@@ -4,8 +4,8 @@ local dbg = require "m3_debug"
 local mem = require "m3_mem"
 local buffer = require "string.buffer"
 local debug_describe = dbg.describe
-local istransaction = data.istransaction
-local mem_save, mem_load, mem_delete = mem.save, mem.load, mem.delete
+local istransaction, data_fusable, data_fuse = data.istransaction, data.fusable, data.fuse
+local mem_lsave, mem_lload, mem_ldelete = mem.lsave, mem.lload, mem.ldelete
 local load = code.load
 local rawget, rawset = rawget, rawset
 
@@ -450,10 +450,38 @@ local function emit_chain(node, chain)
 	end
 end
 
+-- transactions without arguments or return values always continue the chain, so adjacent ones
+-- are compiled into a single function by the data module.
+local function isfusable(node)
+	return gettag(node) == "call" and (node.n or 0) == 0 and istransaction(node.f)
+		and data_fusable(node.f)
+end
+
+local function fusechain(node)
+	local nodes = {}
+	local i = 1
+	while i <= #node do
+		local n = 0
+		while isfusable(node[i+n]) do n = n+1 end
+		if n > 1 then
+			local txs = {}
+			for j=1, n do txs[j] = node[i+j-1].f end
+			local f, m = data_fuse(txs)
+			table.insert(nodes, m > 1 and call(f) or node[i])
+			i = i+m
+		else
+			table.insert(nodes, node[i])
+			i = i+1
+		end
+	end
+	return nodes
+end
+
 function emit_node.all(node)
+	local nodes = fusechain(node)
 	local chain = nil
-	for i=#node, 1, -1 do
-		chain = emit_chain(node[i], chain)
+	for i=#nodes, 1, -1 do
+		chain = emit_chain(nodes[i], chain)
 	end
 	return chain or ctrl_continue
 end
@@ -462,7 +490,7 @@ end
 
 function emit_node.any(node)
 	local buf = buffer.new()
-	buf:put("local copycont, mem_save, mem_load, mem_delete")
+	buf:put("local copycont, mem_lsave, mem_lload, mem_ldelete")
 	local branches = {}
 	for i=1, #node do
 		buf:putf(", branch%d", i)
@@ -470,20 +498,20 @@ function emit_node.any(node)
 	end
 	buf:put(" = ...\n")
 	buf_header(buf)
-	buf:put("local r\nlocal sp = mem_save()\nlocal top2,base2=top+1+top-base,top+1\n")
+	buf:put("local r\nlocal sp = mem_lsave()\nlocal top2,base2=top+1+top-base,top+1\n")
 	for i=1, #node do
 		if i>1 then
-			buf:put("mem_load(sp)\n")
+			buf:put("mem_lload(sp)\n")
 		end
 		if i == #node then
-			buf:putf("mem_delete(sp) do return branch%d(stack, base, top) end\n", i)
+			buf:putf("mem_ldelete(sp) do return branch%d(stack, base, top) end\n", i)
 		else
 			buf:putf("copycont(stack, base2, base, top+1-base) r = branch%d(stack, base2, top2) if r then goto out end\n", i)
 		end
 	end
-	buf:put("::out:: mem_delete(sp) return r end\n")
+	buf:put("::out:: mem_ldelete(sp) return r end\n")
 	return load(buf, code.chunkname(describe(node)))(
-		copycont, mem_save, mem_load, mem_delete, unpack(branches))
+		copycont, mem_lsave, mem_lload, mem_ldelete, unpack(branches))
 end
 
 -- first -------------------------------
@@ -495,7 +523,7 @@ end
 
 function emit_node.first(node)
 	local buf = buffer.new()
-	buf:put("local copycont, mem_save, mem_load, mem_delete, first_aux")
+	buf:put("local copycont, mem_lsave, mem_lload, mem_ldelete, first_aux")
 	local branches = {}
 	for i=1, #node do
 		buf:putf(", branch%d", i)
@@ -506,13 +534,13 @@ function emit_node.first(node)
 	buf:put("stack[top+1] = false\n") -- top+1 = probe
 	buf:put("local top2, base2 = top+2+top-base, top+2\n")
 	buf:put("local r\n")
-	buf:put("local sp = mem_save()\n")
+	buf:put("local sp = mem_lsave()\n")
 	for i=1, #node do
 		if i>1 then
-			buf:put("mem_load(sp)\n")
+			buf:put("mem_lload(sp)\n")
 		end
 		if i == #node then
-			buf:putf("mem_delete(sp) do return branch%d(stack, base, top) end\n", i)
+			buf:putf("mem_ldelete(sp) do return branch%d(stack, base, top) end\n", i)
 		else
 			buf:put("copycont(stack, base2, base, top+1-base)\n")
 			buf:put("stack[top2+1] = top+1\n")
@@ -520,9 +548,9 @@ function emit_node.first(node)
 			buf:putf("r = branch%d(stack, base2, top2+2) if r or stack[top+1] then goto out end\n", i)
 		end
 	end
-	buf:put("::out:: mem_delete(sp) return r end\n")
+	buf:put("::out:: mem_ldelete(sp) return r end\n")
 	return load(buf, code.chunkname(describe(node)))(
-		copycont, mem_save, mem_load, mem_delete, first_aux, unpack(branches))
+		copycont, mem_lsave, mem_lload, mem_ldelete, first_aux, unpack(branches))
 end
 
 -- single ------------------------------
@@ -662,6 +690,43 @@ local function exec(node)
 	return emit(tocontrol(node))(newcont())
 end
 
+local function flatten_calls(node, calls)
+	local tag = gettag(node)
+	if tag == "all" then
+		for _,n in ipairs(node) do
+			local bad = flatten_calls(n, calls)
+			if bad then return bad end
+		end
+	elseif tag == "call" then
+		table.insert(calls, node)
+	else
+		return node
+	end
+end
+
+-- flatten(node) -> {func, ...}
+-- flatten(node) -> nil, description of the first node that branches
+-- straight-line programs, ie. `all' chains of calls, can be run without the control stack by
+-- calling the functions in order until one returns a non-nil value.
+local function flatten(node)
+	local calls = {}
+	local bad = flatten_calls(optimize(tocontrol(node)), calls)
+	if bad then
+		return nil, describe(bad)
+	end
+	local funcs = {}
+	for i,c in ipairs(fusechain(calls)) do
+		local f = callfunc(c)
+		if (c.n or 0) > 0 then
+			local args = {unpack(c, 1, c.n)}
+			funcs[i] = function() return f(unpack(args, 1, c.n)) end
+		else
+			funcs[i] = f
+		end
+	end
+	return funcs
+end
+
 --------------------------------------------------------------------------------
 
 return {
@@ -678,5 +743,6 @@ return {
 	loop     = loop,
 	callcc   = callcc,
 	dynamic  = dynamic,
-	exec     = exec
+	exec     = exec,
+	flatten  = flatten
 }
@@ -1,11 +1,13 @@
 local array = require "m3_array"
 local C = require "m3_C"
+local colfile = require "m3_colfile"
 local db = require "m3_db"
 local cdata = require "m3_cdata"
 local code = require "m3_code"
 local dbg = require "m3_debug"
 local mem = require "m3_mem"
 local fhk = require "fhk"
+local snapshot = require "m3_snapshot"
 local sqlite = require "sqlite"
 local buffer = require "string.buffer"
 local ffi = require "ffi"
@@ -13,14 +15,16 @@ require "table.clear"
 
 local load = code.load
 local event, enabled = dbg.event, dbg.enabled
-local mem_getobj, mem_state = mem.getobj, mem.state()
+local mem_state = mem.state()
 
 local G = fhk.newgraph()
 
 local D = {
 	transactions   = {},
+	txsource       = {}, -- transaction index -> "file:line" where it was defined
 	mapping        = {}, -- node -> data
-	mapping_tables = {}, -- list of table nodes (rebuilt each iteration)
+	mapping_tables = {}, -- list of table nodes (updated each iteration)
+	mapping_new    = {}, -- nodes mapped since the last dataflow_lookup()
 	expr           = {},
 }
 
@@ -188,8 +192,9 @@ end
 
 -- orm-style automagic sql SELECT
 local autoselect_mt = newmeta "autoselect"
-local function autoselect(obj, tab, sql, rename)
-	return setmetatable({obj=obj, tab=tab, sql=sql, rename=rename}, autoselect_mt)
+-- key: {col=..., arg=...} if the rows are selected by a single task argument.
+local function autoselect(obj, tab, sql, rename, key)
+	return setmetatable({obj=obj, tab=tab, sql=sql, rename=rename, key=key}, autoselect_mt)
 end
 
 -- user
@@ -202,10 +207,27 @@ local function call(func, n, buf)
 end
 
 -- buffer
+-- deferred actions are a list of records linked from the newest one, see abuf_commit_().
+-- records are numbered in allocation order, and the tail in work memory holds the newest record
+-- and its number. non-numeric arguments are stored in abuf.objs, with their bit set in `ref'.
+ffi.cdef [[
+	typedef struct m3_ActionRecord {
+		struct m3_ActionRecord *prev;
+		double prevseq;
+		uint64_t ref;
+		int32_t id;
+		double v[?];
+	} m3_ActionRecord;
+	typedef struct m3_ActionTail {
+		m3_ActionRecord *rec;
+		double seq;
+	} m3_ActionTail;
+]]
+
 local buf_mt = newmeta "buf"
 local function databuf()
 	return setmetatable({
-		tail = memslot("int32_t", 0)
+		tail = memslot("m3_ActionTail", function() return ffi.new("m3_ActionTail") end)
 	}, buf_mt)
 end
 
@@ -215,6 +237,12 @@ local function bind(name)
 	return setmetatable({name=name}, bind_mt)
 end
 
+-- memoization key, see transaction_cache()
+local cachekey_mt = newmeta "cachekey"
+local function cachekey()
+	return setmetatable({}, cachekey_mt)
+end
+
 -- TODO: use table dispatch here
 local function visit(o, f, ...)
 	local tag = gettag(o)
@@ -307,12 +335,14 @@ local function map_tab(node)
 			assert(not D.mapping[s.var], "NYI (shared table length)")
 			mapping = dataframe()
 			D.mapping[s.var] = size(mapping)
+			table.insert(D.mapping_new, s.var)
 		else
 			-- don't map it
 			return
 		end
 	end
 	D.mapping[node] = mapping
+	table.insert(D.mapping_new, node)
 end
 
 local function map_var(node)
@@ -337,6 +367,7 @@ local function map_var(node)
 		return
 	end
 	D.mapping[node] = mapping
+	table.insert(D.mapping_new, node)
 	local default = G:var(node.tab, "default'{$}", false, node.name)
 	if default then
 		node.m3_default = default
@@ -388,8 +419,11 @@ resolvetab = function(t)
 	return r
 end
 
+-- transactions with only table actions resolve to the same actions every time, function
+-- actions may depend on the mappings and the graph.
 local function dataflow_transaction(tx)
 	tx.actions = {}
+	tx.m3_dynamic = false
 	local action = function(i,o)
 		table.insert(tx.actions, {
 			input  = resolve(i),
@@ -400,6 +434,7 @@ local function dataflow_transaction(tx)
 		if type(a) == "table" then
 			action(a.input, a.output)
 		else
+			tx.m3_dynamic = true
 			a(action)
 		end
 	end
@@ -424,6 +459,7 @@ local function dataflow_updategraph(dcx)
 		end
 		dcx.last = o
 	end
+	dcx.version = dcx.version+1
 end
 
 local function dataflow_visit(dcx, node)
@@ -455,27 +491,38 @@ local function dataflow_visitexpr(o, dcx)
 	end
 end
 
-local function dataflow_lookup()
-	D.mapping_tables = {}
-	for node in pairs(D.mapping) do
+local function dataflow_lookup(dcx)
+	local new = D.mapping_new
+	if #new == 0 then return end
+	D.mapping_new = {}
+	for _,node in ipairs(new) do
 		if node.op == "TAB" then
 			node.m3_vars = {}
 			table.insert(D.mapping_tables, node)
 		end
 	end
-	for node in pairs(D.mapping) do
+	for _,node in ipairs(new) do
 		if node.op == "VAR" then
 			table.insert(node.tab.m3_vars, node)
 		end
 	end
+	dcx.version = dcx.version+1
 end
 
+-- worklist iteration: only transactions that were never resolved, or have function actions
+-- and saw the mappings or the graph change since, are resolved and walked again.
+-- everything else was already visited, and visiting is idempotent.
 local function dataflow_iter(dcx)
 	-- this must be done first, because transactions use this
-	dataflow_lookup()
+	dataflow_lookup(dcx)
 	-- this may add more nodes to the graph, so resolve everything first before visiting.
+	local work = {}
 	for _,tx in ipairs(D.transactions) do
-		dataflow_transaction(tx)
+		if not tx.m3_version or (tx.m3_dynamic and tx.m3_version ~= dcx.version) then
+			tx.m3_version = dcx.version
+			dataflow_transaction(tx)
+			table.insert(work, tx)
+		end
 	end
 	-- compute models and tablen
 	if dcx.last.next then
@@ -492,8 +539,8 @@ local function dataflow_iter(dcx)
 			dataflow_visit(dcx, node)
 		end
 	end
-	-- visit read variables again
-	for _,tx in ipairs(D.transactions) do
+	-- visit read variables of the resolved transactions
+	for _,tx in ipairs(work) do
 		for _,a in ipairs(tx.actions) do
 			walk(a.input, dataflow_visitexpr, dcx)
 		end
@@ -503,7 +550,8 @@ end
 local function dataflow()
 	local dcx = {
 		last = G.objs[0],
-		backlog = {}
+		backlog = {},
+		version = 0
 	}
 	for _=1, 1000 do
 		dcx.fixpoint = true
@@ -519,14 +567,117 @@ local function slot_cmp(a, b)
 	return ffi.alignof(a.ctype) > ffi.alignof(b.ctype)
 end
 
+local function markslot(o,m,all)
+	local tag = gettag(o)
+	if tag == "memslot" then
+		all[o] = true
+		o[m] = true
+	elseif tag == "column" then
+		o.mark = true -- for dataframe_ctype / autoselect
+		markslot(o.df.slot, m, all)
+	elseif tag == "buf" then
+		markslot(o.tail, m, all)
+		if m == "write" then
+			o.tail.read = true
+		end
+	end
+end
+
+local LAYOUT_BLOCKSIZE = C.CONFIG_BLOCKSIZE
+local LAYOUT_MAXBLOCKS = 64 -- block masks are 64 bits
+
+-- transaction call counts for the work memory layout, see layout_profile().
+-- profile_counts is keyed by profile_keys(), profile_run by definition order.
+local profile_path, profile_counts, profile_run
+
+-- transactions are identified in profiles by where they are defined, so that a profile still
+-- applies after the script is reordered. repeated locations are numbered.
+local function profile_keys()
+	local keys, seen = {}, {}
+	for i,src in ipairs(D.txsource) do
+		local n = (seen[src] or 0)+1
+		seen[src] = n
+		keys[i] = n > 1 and string.format("%s#%d", src, n) or src
+	end
+	return keys
+end
+
+local function alignup(ofs, align)
+	return bit.band(ofs + align-1, bit.bnot(align-1))
+end
+
+local function slot_writers()
+	local writers = {}
+	for i,tx in ipairs(D.transactions) do
+		local ws = {}
+		for _,a in ipairs(tx.actions) do
+			walk(a.output, markslot, "write", ws)
+		end
+		for o in pairs(ws) do
+			writers[o] = writers[o] or {}
+			table.insert(writers[o], i)
+		end
+	end
+	return writers
+end
+
+local function group_cmp(a, b)
+	if a.weight ~= b.weight then
+		return a.weight > b.weight
+	end
+	return a.key < b.key
+end
+
+-- slots written by the same set of transactions are packed together, so that each transaction
+-- dirties as few blocks as possible. groups that are written more often (by the recorded profile,
+-- or by the number of writers without one) go first, and get padded to a block boundary when
+-- that saves a block and the padding fits in the block mask.
 local function worklayout(slots)
-	table.sort(slots, slot_cmp)
-	local ptr = 0
+	local keys = profile_keys()
+	local writers = slot_writers()
+	local groups, bykey = {}, {}
 	for _,slot in ipairs(slots) do
-		local align = ffi.alignof(slot.ctype)
-		ptr = bit.band(ptr + align-1, bit.bnot(align-1))
-		slot.ofs = ptr
-		ptr = ptr + ffi.sizeof(slot.ctype)
+		local txs = writers[slot] or {}
+		local key = table.concat(txs, ",")
+		local g = bykey[key]
+		if not g then
+			local weight = 0
+			for _,i in ipairs(txs) do
+				weight = weight + (profile_counts and (profile_counts[keys[i]] or 0) or 1)
+			end
+			g = { key=key, weight=weight, slots={} }
+			bykey[key] = g
+			table.insert(groups, g)
+		end
+		table.insert(g.slots, slot)
+	end
+	local budget = LAYOUT_MAXBLOCKS*LAYOUT_BLOCKSIZE
+	for _,g in ipairs(groups) do
+		table.sort(g.slots, slot_cmp)
+		g.align = ffi.alignof(g.slots[1].ctype)
+		local size = 0
+		for _,slot in ipairs(g.slots) do
+			size = alignup(size, ffi.alignof(slot.ctype)) + ffi.sizeof(slot.ctype)
+		end
+		g.size = size
+		budget = budget - size - g.align
+	end
+	table.sort(groups, group_cmp)
+	local ptr = 0
+	for _,g in ipairs(groups) do
+		ptr = alignup(ptr, g.align)
+		local pad = alignup(ptr, LAYOUT_BLOCKSIZE) - ptr
+		if g.weight > 0 and g.size > 0 and pad > 0 and pad <= budget
+			and math.floor((ptr+g.size-1)/LAYOUT_BLOCKSIZE) - math.floor(ptr/LAYOUT_BLOCKSIZE)
+				>= math.ceil(g.size/LAYOUT_BLOCKSIZE) then
+			ptr = ptr + pad
+			budget = budget - pad
+		end
+		for _,slot in ipairs(g.slots) do
+			ptr = alignup(ptr, ffi.alignof(slot.ctype))
+			slot.ofs = ptr
+			ptr = ptr + ffi.sizeof(slot.ctype)
+		end
 	end
 	local work = mem.createworkspace(ptr)
 	for _, slot in ipairs(slots) do
@@ -571,22 +722,6 @@ local function ctype_isstruct(ct)
 	return ctype_type(ct) == 1
 end
 
-local function markslot(o,m,all)
-	local tag = gettag(o)
-	if tag == "memslot" then
-		all[o] = true
-		o[m] = true
-	elseif tag == "column" then
-		o.mark = true -- for dataframe_ctype / autoselect
-		markslot(o.df.slot, m, all)
-	elseif tag == "buf" then
-		markslot(o.tail, m, all)
-		if m == "write" then
-			o.tail.read = true
-		end
-	end
-end
-
 local function memlayout()
 	local all = {}
 	markslot(D.G_state, "read", all)
@@ -776,6 +911,8 @@ local function visit_expr(o, tx)
 		if not tx.query_field[o.source] then
 			table.insert(tx.query_field, o.e or o.source)
 			tx.query_field[o.source] = #tx.query_field
+			-- keep the node for makequerymasks()
+			o.node = o.node or o.e
 			o.e = nil -- don't reuse the expression object (TODO(fhk): allow this (?))
 		end
 	end
@@ -812,7 +949,55 @@ local function makeresets()
 	end
 end
 
+-- collect the resets of every mapped object that `node` transitively depends on.
+local function visit_deps(node, seen, resets)
+	if seen[node] then return end
+	seen[node] = true
+	for _,parent in ipairs(fhk.refs(node)) do
+		visit_deps(parent, seen, resets)
+	end
+	if node.m3_models then
+		for _,model in ipairs(node.m3_models) do
+			visit_deps(model, seen, resets)
+		end
+	end
+	if node.m3_default then
+		visit_deps(node.m3_default, seen, resets)
+	end
+	local data = D.mapping[node]
+	if data and data.reset then
+		for reset in pairs(data.reset) do
+			resets[reset] = true
+		end
+	end
+end
+
+-- a query only needs a new instance when a reset it depends on is pending.
+local function makequerymasks()
+	for _,tx in ipairs(D.transactions) do
+		if tx.query then
+			local seen = {}
+			tx.query_resets = {}
+			for _,o in ipairs(tx.query_field) do
+				local node = D.expr[o] and D.expr[o].node or o
+				if type(node) ~= "string" then
+					visit_deps(node, seen, tx.query_resets)
+				end
+			end
+		end
+	end
+end
+
 local function readresetmasks()
+	for _,tx in ipairs(D.transactions) do
+		if tx.query_resets then
+			local mask = 0ull
+			for reset in pairs(tx.query_resets) do
+				mask = bit.bor(mask, G.reset[reset] or 0ull)
+			end
+			tx.query_mask = mask
+		end
+	end
 	for _,tx in ipairs(D.transactions) do
 		if tx.reset then
 			tx.reset = G.reset[tx.reset]
@@ -823,6 +1008,7 @@ end
 local function compilegraph(alloc)
 	makequeries()
 	makeresets()
+	makequerymasks()
 	makemappings()
 	G = assert(G:compile())
 	readresetmasks()
@@ -834,31 +1020,87 @@ end
 
 ---- Action buffers ------------------------------------------------------------
 
+-- trampolines by record id.
+local abuf_funcs = {}
+
+-- record memory (abuf.alloc, created by init()) and the non-numeric arguments of records.
+-- a record is never touched again once its number is at most abuf.committed, so when every
+-- record is committed, all of them are reclaimed at once.
+local abuf = {
+	objs      = {},
+	nobj      = 0,
+	seq       = 0,
+	committed = 0
+}
+
 local function abuf_trampoline(f, n)
 	local buf = buffer.new()
-	buf:put("local f = ...\nreturn function(o,b,i)\nf(")
+	buf:put("local f, objs, band, lshift = ...\n")
+	if n > 0 then
+		buf:put("local function arg(r, i)\n")
+		buf:put("if band(r.ref, lshift(1ull, i)) ~= 0 then return objs[r.v[i]] end\n")
+		buf:put("return r.v[i]\nend\n")
+	end
+	buf:put("return function(r)\nif r.ref == 0 then f(")
 	for i=1, n do
 		if i>1 then buf:put(",") end
-		buf:putf("o._%d", i)
+		buf:putf("r.v[%d]", i-1)
 	end
-	buf:put(") if i>=0 then return b[i]:call(b,i-1) end end\n")
-	return load(buf, code.chunkname(string.format("action %s", dbg.describe(f))))(f)
+	buf:put(") else f(")
+	for i=1, n do
+		if i>1 then buf:put(",") end
+		buf:putf("arg(r,%d)", i-1)
+	end
+	buf:put(") end\nend\n")
+	table.insert(abuf_funcs, load(buf, code.chunkname(string.format("action %s", dbg.describe(f))))(
+		f, abuf.objs, bit.band, bit.lshift))
+	return #abuf_funcs
+end
+
+function abuf.push(tail, size, id)
+	local r = ffi.cast("m3_ActionRecord *", mem.allocfrom(abuf.alloc, size,
+		ffi.alignof("m3_ActionRecord")))
+	r.prev = tail.rec
+	r.prevseq = tail.seq
+	r.ref = 0
+	r.id = id
+	local seq = abuf.seq+1
+	abuf.seq = seq
+	tail.rec = r
+	tail.seq = seq
+	return r
+end
+
+function abuf.obj(o)
+	local idx = abuf.nobj+1
+	abuf.nobj = idx
+	abuf.objs[idx] = o
+	return idx
 end
 
 local function abuf_commit_(tail)
-	local buf = {}
-	local n = 0
-	while true do
-		local o = mem_getobj(tail)
-		-- prev=nil -> already flushed
-		if (not o) or (not o.prev) then break end
-		buf[n] = o
-		n = n+1
-		tail = o.prev
-		o.prev = nil
-	end
-	if n > 0 then
-		return buf[n-1]:call(buf, n-2)
+	local seq, committed = tail.seq, abuf.committed
+	if seq <= committed then return end
+	-- flip the uncommitted records to oldest first. the walk stops at the first committed
+	-- number, without touching the record, which may already be reclaimed.
+	local r, head = tail.rec, nil
+	while seq > committed do
+		local prev, prevseq = r.prev, r.prevseq
+		r.prev = head
+		head = r
+		r, seq = prev, prevseq
+	end
+	abuf.committed = tail.seq
+	while head ~= nil do
+		r = head
+		head = r.prev
+		abuf_funcs[r.id](r)
+	end
+	-- records of branches that were rolled back stay until a later commit passes them.
+	if abuf.committed == abuf.seq then
+		mem.reset(abuf.alloc)
+		table.clear(abuf.objs)
+		abuf.nobj = 0
 	end
 end
 
@@ -866,7 +1108,7 @@ local abuf_commit = load([[
 	local abuf_commit_ = ...
 	local tail
 	return function()
-		return abuf_commit_(tail[0])
+		return abuf_commit_(tail)
 	end
 ]])(abuf_commit_)
 
@@ -939,6 +1181,7 @@ function emit_read.literal(ctx, literal)
 end
 
 function emit_read.func(ctx, call)
+	ctx.call = true
 	return newvar(ctx, string.format("local %s = %s()\n", resname, ctx.uv[call.func]))
 end
 
@@ -1033,24 +1276,34 @@ end
 
 -- TODO: reuse trampoline for f/n pairs
 local function emitbufcall(ctx, buf, f, n, value)
-	ctx.uv.objref = mem.objref
-	local tail = ctx.uv[buf.tail.ptr]
+	if n > 64 then
+		error(string.format("too many arguments for deferred call: %d", n))
+	end
+	ctx.uv.abuf_push = abuf.push
 	local name = ctx:name()
-	ctx.buf:putf("do local %s = {prev=%s[0], call=%s}\n", name, tail, ctx.uv[abuf_trampoline(f, n)])
+	ctx.buf:putf("do local %s = abuf_push(%s, %d, %d)\n", name, ctx.uv[buf.tail.ptr],
+		ffi.sizeof("m3_ActionRecord", n), abuf_trampoline(f, n))
 	if n>0 then
-		for i=1, n do
-			if i>1 then ctx.buf:put(",") end
-			ctx.buf:putf("%s._%d", name, i)
+		ctx.uv.type = type
+		ctx.uv.abuf_obj = abuf.obj
+		ctx.uv.bor = bit.bor
+		local args = {}
+		for i=1, n do args[i] = ctx:name() end
+		ctx.buf:putf("local %s = %s\n", table.concat(args, ","), tovalue(value))
+		for i,a in ipairs(args) do
+			ctx.buf:putf("if type(%s) == 'number' then %s.v[%d] = %s\n", a, name, i-1, a)
+			ctx.buf:putf("else %s.v[%d] = abuf_obj(%s) %s.ref = bor(%s.ref, 0x%xull) end\n",
+				name, i-1, a, name, name, bit.lshift(1ull, i-1))
 		end
-		ctx.buf:putf(" = %s\n", tovalue(value))
 	end
-	ctx.buf:putf("%s[0] = objref(%s) end\n", tail, name)
+	ctx.buf:put("end\n")
 end
 
 function emit_write.func(ctx, call, value)
 	if call.buf then
 		emitbufcall(ctx, call.buf, call.func, call.n, value)
 	else
+		ctx.call = true
 		ctx.buf:putf("%s(%s)\n", ctx.uv[call.func], value)
 	end
 end
@@ -1059,6 +1312,294 @@ function emit_write.dml(ctx, dml, value)
 	emitbufcall(ctx, D.actions, db.statement(dml.sql), dml.n, tovalue(value))
 end
 
+-- batched autoselect input.
+-- prefetch(rows) loads the input rows of a whole batch of tasks with ordered queries over the
+-- batch's keys, PREFETCH_KEYS keys per query, for each keyed dataframe autoselect. each task in
+-- the batch then copies its slice of the staged columns instead of running its own queries.
+-- tasks whose key wasn't staged fall back to sql.
+-- stages may also be backed by an input snapshot, which holds the rows of every key.
+local PREFETCH_KEYS = 64
+local prefetch_stages = {} -- sql => stage
+local snapshot_tables -- snapshot in use, see snapshot_use()
+
+-- sqlite returns integer keys as int64 cdata, which are not equal as table keys.
+local function stagekey(k)
+	if type(k) == "cdata" then return tonumber(k) end
+	return k
+end
+
+local function stage_grow(stage, n)
+	local cap = math.max(2*stage.cap, n, 64)
+	for i,c in ipairs(stage.cols) do
+		local data = ffi.new(ffi.typeof("$[?]", c.ctype), cap)
+		if stage.num > 0 then
+			ffi.copy(data, stage.data[i], stage.num*ffi.sizeof(c.ctype))
+		end
+		stage.data[i] = data
+	end
+	stage.cap = cap
+end
+
+local function stage_clear(stage)
+	stage.num = 0
+	table.clear(stage.staged)
+	table.clear(stage.ofs)
+	table.clear(stage.cnt)
+end
+
+-- returns ofs, num if the rows of `key` are staged.
+local function stage_lookup(stage, key)
+	key = stagekey(key)
+	local snap = stage.snap
+	if snap then
+		if type(key) ~= "number" then return end
+		local keys = snap.keys
+		local lo, hi = 0, snap.nkey
+		while lo < hi do
+			local mid = bit.rshift(lo+hi, 1)
+			if keys[mid] < key then lo = mid+1 else hi = mid end
+		end
+		if lo < snap.nkey and keys[lo] == key then
+			local index = snap.index
+			return index[lo], index[lo+1]-index[lo]
+		end
+		-- the snapshot holds the whole table, so a missing key has no rows.
+		return 0, 0
+	end
+	local ofs = stage.ofs[key]
+	if ofs then
+		return ofs, stage.cnt[key]
+	end
+	if stage.staged[key] then
+		-- staged, but no rows.
+		return 0, 0
+	end
+end
+
+local function stage_loadfunc(cols, nulls)
+	local buf = buffer.new()
+	buf:put("local stage_grow, uv, stagekey = ...\n")
+	buf:put("return function(stage, stmt)\n")
+	buf:put("local data, ofs, cnt, n, prev = stage.data, stage.ofs, stage.cnt, stage.num, nil\n")
+	buf:put("while stmt:step() do\n")
+	buf:put("if n >= stage.cap then stage_grow(stage, n+1) data = stage.data end\n")
+	buf:put("local k = stagekey(stmt:col(0))\n")
+	buf:put("if k ~= prev then ofs[k] = n cnt[k] = 0 prev = k end\n")
+	buf:put("cnt[k] = cnt[k]+1\n")
+	for i,c in ipairs(cols) do
+		buf:putf("data[%d][n] = ", i)
+		if nulls[c] then
+			buf:putf("stmt:col(%d) or uv[%d]\n", i, i)
+		else
+			buf:putf("stmt:%s(%d)\n", cdata.isfp(c.ctype) and "double" or "int", i)
+		end
+	end
+	buf:put("n = n+1\nend\nstmt:reset()\nstage.num = n\nend\n")
+	local dummy = {}
+	for i,c in ipairs(cols) do dummy[i] = c.dummy end
+	return load(buf)(stage_grow, dummy, stagekey)
+end
+
+-- identifies the contents of the stage's table, so that a snapshot of another database or of
+-- older contents isn't used by mistake.
+local function stage_source(stage)
+	local stmt = db.statement(stage.sourcesql).sqlite3_stmt
+	stmt:step()
+	local nrow, lo, hi = stmt:col(0), stmt:col(1), stmt:col(2)
+	stmt:reset()
+	return {
+		db   = db.maindb(),
+		nrow = tonumber(nrow),
+		min  = stagekey(lo),
+		max  = stagekey(hi)
+	}
+end
+
+local function stage_attach(stage)
+	local t = snapshot_tables and snapshot_tables[stage.fullsql]
+	if not (t and #t.cols == #stage.cols) then return end
+	for i,c in ipairs(stage.cols) do
+		if t.cols[i].ctype ~= tostring(c.ctype) then return end
+	end
+	local have, want = t.source, stage_source(stage)
+	if not (have and have.db == want.db and have.nrow == want.nrow and have.min == want.min
+		and have.max == want.max) then
+		error(string.format("input snapshot is stale or from another database: `%s' "
+			.. "(snapshot: %s, %s rows; database: %s, %d rows)", stage.fullsql,
+			have and have.db, have and have.nrow, want.db, want.nrow))
+	end
+	stage.snap = t
+	for i,c in ipairs(stage.cols) do
+		stage.data[i] = ffi.cast(ffi.typeof("$ *", c.ctype), t.cols[i].data)
+	end
+end
+
+local function stage_new(asel, cols, nulls)
+	local tname = sqlite.escape(asel.tab)
+	local kname = string.format("%s.%s", tname, sqlite.escape(asel.key.col))
+	-- sorted so that the snapshot layout doesn't depend on table iteration order.
+	cols = {unpack(cols)}
+	table.sort(cols, function(a, b) return a.name < b.name end)
+	local names = { kname }
+	for _,c in ipairs(cols) do
+		table.insert(names, string.format("%s.%s", tname, sqlite.escape(asel.rename(c.name))))
+	end
+	local select = string.format("SELECT %s FROM %s", table.concat(names, ", "), tname)
+	local params = {}
+	for i=1, PREFETCH_KEYS do params[i] = "?" end
+	local sql = string.format("%s WHERE %s IN (%s) ORDER BY %s", select, kname,
+		table.concat(params, ","), kname)
+	local key = string.format("%s#%d", sql, asel.key.arg)
+	local stage = prefetch_stages[key]
+	if not stage then
+		local colidx = {}
+		for i,c in ipairs(cols) do colidx[c.name] = i end
+		stage = {
+			stmt    = db.statement(sql),
+			-- rows with a NULL key are never selected by a task.
+			fullsql = string.format("%s WHERE %s IS NOT NULL ORDER BY %s", select, kname, kname),
+			sourcesql = string.format("SELECT COUNT(*), MIN(%s), MAX(%s) FROM %s WHERE %s IS NOT NULL",
+				kname, kname, tname, kname),
+			arg     = asel.key.arg,
+			cols    = cols,
+			colidx  = colidx,
+			load    = stage_loadfunc(cols, nulls),
+			data    = {},
+			cap     = 0,
+			num     = 0,
+			staged  = {},
+			ofs     = {},
+			cnt     = {}
+		}
+		stage_attach(stage)
+		prefetch_stages[key] = stage
+	end
+	return stage
+end
+
+-- prefetch(rows): stage the input rows for a batch of task argument lists.
+-- prefetch():     drop the staged rows.
+local function prefetch(rows)
+	for _,stage in pairs(prefetch_stages) do
+		if not stage.snap then
+			stage_clear(stage)
+			if rows then
+				local keys, staged = {}, stage.staged
+				for _,row in ipairs(rows) do
+					local k = stagekey(row[stage.arg])
+					if k ~= nil and not staged[k] then
+						staged[k] = true
+						table.insert(keys, k)
+					end
+				end
+				local stmt, args = stage.stmt.sqlite3_stmt, {}
+				for i=1, #keys, PREFETCH_KEYS do
+					-- a short tail repeats its last key.
+					for j=1, PREFETCH_KEYS do
+						args[j] = keys[math.min(i+j-1, #keys)]
+					end
+					stmt:bindargs(unpack(args, 1, PREFETCH_KEYS))
+					stage.load(stage, stmt)
+				end
+			end
+		end
+	end
+end
+
+-- snapshot_write(path): write the whole input of every keyed dataframe autoselect compiled so
+-- far into an input snapshot, see m3_snapshot.
+local function snapshot_write(path)
+	local tables = {}
+	for _,stage in pairs(prefetch_stages) do
+		if not (stage.snap or tables[stage.fullsql]) then
+			stage_clear(stage)
+			stage.load(stage, db.statement(stage.fullsql).sqlite3_stmt)
+			local keys = {}
+			for k in pairs(stage.ofs) do
+				if type(k) ~= "number" then keys = nil break end
+				-- keys are stored as doubles, and integer keys this large have already been
+				-- rounded by stagekey().
+				if math.abs(k) >= 2^53 then
+					error(string.format("input snapshot keys must be below 2^53 in magnitude: `%s' has %s",
+						stage.fullsql, k))
+				end
+				table.insert(keys, k)
+			end
+			if keys then
+				table.sort(keys)
+				if stage.num >= stage.cap then stage_grow(stage, stage.num+1) end
+				local t = {
+					nkey  = #keys,
+					nrow  = stage.num,
+					keys  = ffi.new("double[?]", #keys+1),
+					index = ffi.new("uint32_t[?]", #keys+1),
+					cols  = {}
+				}
+				for i,k in ipairs(keys) do
+					t.keys[i-1] = k
+					t.index[i-1] = stage.ofs[k]
+				end
+				t.index[#keys] = stage.num
+				for i,c in ipairs(stage.cols) do
+					t.cols[i] = { ctype=c.ctype, data=stage.data[i] }
+				end
+				t.source = stage_source(stage)
+				tables[stage.fullsql] = t
+			end
+		end
+	end
+	snapshot.write(path, tables)
+	for _,stage in pairs(prefetch_stages) do
+		if not stage.snap then stage_clear(stage) end
+	end
+end
+
+-- snapshot_use(path): serve autoselect inputs from an input snapshot where possible.
+-- each table is checked against the database when its autoselect is attached to the snapshot,
+-- and a snapshot that doesn't match is an error.
+local function snapshot_use(path)
+	snapshot_tables = snapshot.open(path)
+	for _,stage in pairs(prefetch_stages) do
+		if not stage.snap then stage_attach(stage) end
+	end
+end
+
+-- first chunk size of a dataframe autoselect, following chunks double the size.
+local AUTOSELECT_CHUNK = 8
+
+local SQL_KIND = {}
+for ctype, kind in pairs({
+	double  = C.M3_SQL_F64, float    = C.M3_SQL_F32,
+	int64_t = C.M3_SQL_I64, int32_t  = C.M3_SQL_I32, int16_t  = C.M3_SQL_I16, int8_t  = C.M3_SQL_I8,
+	uint64_t = C.M3_SQL_U64, uint32_t = C.M3_SQL_U32, uint16_t = C.M3_SQL_U16, uint8_t = C.M3_SQL_U8,
+	bool    = C.M3_SQL_U8
+}) do
+	SQL_KIND[tonumber(ffi.typeof(ctype))] = kind
+end
+
+-- returns an m3_SqlColumn array for m3_sql_rows(), or nil if some column isn't a scalar
+-- number type.
+local function sqlcolumns(cols, nulls)
+	local spec = ffi.new("m3_SqlColumn[?]", math.max(#cols, 1))
+	for i,c in ipairs(cols) do
+		local kind = SQL_KIND[tonumber(c.ctype)]
+		if not kind then return end
+		spec[i-1].kind = kind
+		if nulls[c] then
+			if type(c.dummy) ~= "number" then return end
+			spec[i-1].null = 1
+			spec[i-1].dummy = c.dummy
+		end
+	end
+	return spec
+end
+
+local function sql_error(stmt)
+	local msg = ffi.string(C.sqlite3_errmsg(C.sqlite3_db_handle(stmt)))
+	stmt:reset()
+	error(msg, 2)
+end
+
 function emit_write.autoselect(ctx, asel, value)
 	assert(value, "cannot mutate autoselect")
 	local tag = gettag(asel.obj)
@@ -1114,33 +1655,73 @@ function emit_write.autoselect(ctx, asel, value)
 		end
 		if #cols == 0 and #dummies == 0 then return end
 		local ptr = ctx.uv[asel.obj.slot.ptr]
-		local sqlcount = {sqlite.sql("SELECT", "COUNT(*)"), sqlite.sql("FROM", tname), asel.sql}
-		ctx.buf:putf(
-			"do\nlocal s=%s.sqlite3_stmt s:bindargs(%s) s:step() local num=s:int(0) local base=%s:alloc(num) s:reset()\n",
-			ctx.uv[db.statement(sqlcount)], value, ptr
-		)
+		if asel.key then
+			local st = stage_new(asel, cols, nulls)
+			local stage = ctx.uv[st]
+			ctx.uv.stage_lookup = stage_lookup
+			ctx.uv.ffi_copy = ffi.copy
+			ctx.buf:putf(
+				"do local ofs, num = stage_lookup(%s, %s)\nif ofs then local base=%s:alloc(num)\n",
+				stage, value, ptr
+			)
+			for _,c in ipairs(cols) do
+				ctx.buf:putf("ffi_copy(%s.%s+base, %s.data[%d]+ofs, num*%d)\n",
+					ptr, c.name, stage, st.colidx[c.name], ffi.sizeof(c.ctype))
+			end
+			for _,c in ipairs(dummies) do
+				ctx.buf:putf("for i=0, num-1 do %s.%s[base+i] = %s end\n", ptr, c.name, ctx.uv[c.dummy])
+			end
+			ctx.buf:put("else\n")
+		end
 		if #names == 0 then
 			-- hack to ensure the SELECT statement compiles.
 			-- a proper implementation would just omit in the following loop.
 			names[1] = "0"
 		end
 		local sql = {sqlite.sql("SELECT", unpack(names)), sqlite.sql("FROM", tname), asel.sql}
+		-- single pass: rows are read in chunks into geometrically growing columns, and the
+		-- unused tail of the last chunk is dropped.
 		ctx.buf:putf(
-			"local r=%s.sqlite3_stmt r:bindargs(%s) for i=0, num-1 do r:step()\n",
-			ctx.uv[db.statement(sql)], value
+			"do\nlocal r=%s.sqlite3_stmt r:bindargs(%s)\nlocal base, n, lim = %s.num, 0, 0\nrepeat\n",
+			ctx.uv[db.statement(sql)], value, ptr
 		)
-		for i,c in ipairs(cols) do
-			ctx.buf:putf("%s.%s[base+i] = ", ptr, c.name)
-			if nulls[c] then
-				ctx.buf:putf("r:col(%d) or %s\n", i-1, ctx.uv[c.dummy])
-			else
-				ctx.buf:putf("r:%s(%d)\n", cdata.isfp(c.ctype) and "double" or "int", i-1)
+		ctx.buf:putf("local k = lim > 0 and lim or %d %s:alloc(k) lim = lim+k\n", AUTOSELECT_CHUNK, ptr)
+		local spec = sqlcolumns(cols, nulls)
+		if spec then
+			ctx.uv.sql_rows = C.m3_sql_rows
+			ctx.uv.sql_error = sql_error
+			local sp = ctx.uv[spec]
+			for i,c in ipairs(cols) do
+				ctx.buf:putf("%s[%d].ptr = %s.%s\n", sp, i-1, ptr, c.name)
+			end
+			ctx.buf:putf(
+				"local got = sql_rows(r, %s, %d, base+n, lim-n)\nif got < 0 then sql_error(r) end\nn = n+tonumber(got)\n",
+				sp, #cols
+			)
+		else
+			ctx.buf:put("while n < lim and r:step() do\nlocal i = n\n")
+			for i,c in ipairs(cols) do
+				ctx.buf:putf("%s.%s[base+i] = ", ptr, c.name)
+				if nulls[c] then
+					ctx.buf:putf("r:col(%d) or %s\n", i-1, ctx.uv[c.dummy])
+				else
+					ctx.buf:putf("r:%s(%d)\n", cdata.isfp(c.ctype) and "double" or "int", i-1)
+				end
+			end
+			ctx.buf:put("n = n+1\nend\n")
+		end
+		ctx.buf:putf("until n < lim\nr:reset()\n%s.num = base+n\n", ptr)
+		if #dummies > 0 then
+			ctx.buf:put("for i=0, n-1 do\n")
+			for _,c in ipairs(dummies) do
+				ctx.buf:putf("%s.%s[base+i] = %s\n", ptr, c.name, ctx.uv[c.dummy])
 			end
+			ctx.buf:put("end\n")
 		end
-		for _,c in ipairs(dummies) do
-			ctx.buf:putf("%s.%s[base+i] = %s\n", ptr, c.name, ctx.uv[c.dummy])
+		ctx.buf:put("end\n")
+		if asel.key then
+			ctx.buf:put("end end\n")
 		end
-		ctx.buf:put("end\nr:reset() end\n")
 	else
 		error(string.format("cannot autoselect into %s", tag))
 	end
@@ -1154,6 +1735,7 @@ function emit_write.ret(ctx, ret, value)
 end
 
 function emit_write.mutate(ctx, mut, value)
+	ctx.call = true
 	ctx.buf:putf("%s(%s", ctx.uv[mut.f], emitwrite(ctx, mut.data))
 	if value and value ~= "" then
 		ctx.buf:putf(", %s", value)
@@ -1187,10 +1769,156 @@ local function visit_mmask(o, ctx)
 	ctx.mmask = bit.bor(ctx.mmask or 0ull, cdatamask(ofs, ffi.sizeof(o.ctype)))
 end
 
-local function compiletransaction(tx, graph_instance)
+-- buffers for query results that are reused on every call, see transactionfrag().
+local query_scratch = {}
+
+-- memoization caches, in definition order. each cache keeps two generations of nested tables
+-- key1 -> key2 -> ... -> {results}, and drops the older one when the newer one fills up.
+local caches = {}
+
+local function cache_lookup(t, n, ...)
+	for i=1, n-1 do
+		t = t[(select(i, ...))]
+		if not t then return end
+	end
+	return t[(select(n, ...))]
+end
+
+local function cache_put(c, v, ...)
+	if c.num >= c.size then
+		c.old, c.cur, c.num = c.cur, {}, 0
+	end
+	local t = c.cur
+	for i=1, c.nkey do
+		local k = select(i, ...)
+		if k == nil or k ~= k then return end -- nil and nan can't be keys
+		if i == c.nkey then
+			if t[k] == nil then c.num = c.num+1 end
+			t[k] = v
+		else
+			local s = t[k]
+			if not s then
+				s = {}
+				t[k] = s
+			end
+			t = s
+		end
+	end
+end
+
+local function cache_get(c, ...)
+	local v = cache_lookup(c.cur, c.nkey, ...)
+	if not v and c.old then
+		v = cache_lookup(c.old, c.nkey, ...)
+		if v then cache_put(c, v, ...) end
+	end
+	if v then
+		c.hits = c.hits+1
+	else
+		c.misses = c.misses+1
+	end
+	return v
+end
+
+local function iscachekey(o, tx)
+	if gettag(o) == "expr" then
+		error(string.format("cache key of transaction %p reads the graph", tx))
+	end
+end
+
+-- cached results are handed out by later calls, after the frame memory and work memory they
+-- could point into have been reset or overwritten, so only plain values can be cached.
+local function iscacheresult(o, tx, q)
+	local tag = gettag(o)
+	if tag == "column" or tag == "dataframe"
+		or (tag == "memslot" and ctype_isstruct(o.ctype))
+		or (tag == "expr" and type(q[string.format("v%d", tx.query_field[o.source])]) == "cdata")
+	then
+		error(string.format("cached transaction %p returns a reference (%s)", tx, tag))
+	end
+end
+
+local function cache_check(c, v)
+	for i=1, v.n do
+		local t = type(v[i])
+		if t ~= "number" and t ~= "string" and t ~= "boolean" and t ~= "nil" then
+			error(string.format("cached transaction %p returns a %s", c.tx, t))
+		end
+	end
+	return v
+end
+
+-- can a reference into the query result outlive the call? fields that read as plain values are
+-- copied, and so are references written to memory slots or columns, but references that are
+-- returned or passed to a deferred call are kept.
+local function isqueryescape(tx, ctype)
+	local q = ffi.new(ctype)
+	local keep, ref
+	local function iskeeper(o)
+		local tag = gettag(o)
+		if tag == "ret" or tag == "func" or tag == "dml" then keep = true end
+	end
+	local function isqueryref(o)
+		if gettag(o) == "expr"
+			and type(q[string.format("v%d", tx.query_field[o.source])]) == "cdata" then
+			ref = true
+		end
+	end
+	for _,a in ipairs(tx.actions) do
+		keep = false
+		walk(a.output, iskeeper)
+		if keep then
+			walk(a.input, isqueryref)
+			if ref then return true end
+		end
+	end
+	return false
+end
+
+-- query results are only read by the transaction itself, so when no reference into the result
+-- escapes and the transaction doesn't call out (and possibly back into itself), a single buffer
+-- per transaction is reused on every call. the result has the same size on every call, so the
+-- buffer never needs to grow. otherwise results go to frame memory, where references that
+-- escape the transaction stay valid until the frame is reset by load() or deleted.
+--
+-- a transaction fragment is the body of a compiled transaction, split around its query, so that
+-- adjacent transactions can be compiled into a single function, see fuse().
+local function transactionfrag(tx, graph_instance, idx)
 	local ctx = code.new()
 	ctx.narg = 0
 	ctx.nret = 0
+	local frag = { uv=ctx.uv, reset=tx.reset }
+	if profile_run then
+		ctx.uv.profile_run = profile_run
+		ctx.buf:putf("profile_run[%d] = profile_run[%d]+1\n", idx, idx)
+	end
+	local keys
+	if tx.m3_cache then
+		keys = {}
+		local q = tx.query and ffi.new(G[tx.query].ctype)
+		for _,a in ipairs(tx.actions) do
+			local tag = gettag(a.output)
+			if tag == "cachekey" then
+				walk(a.input, iscachekey, tx)
+				table.insert(keys, newvar(ctx, emitread(ctx, a.input)))
+			elseif tag == "ret" then
+				walk(a.input, iscacheresult, tx, q)
+			elseif tag ~= "bind" then
+				error(string.format("cached transaction %p writes data", tx))
+			end
+		end
+		local c = { size=math.ceil(tx.m3_cache/2), nkey=#keys, cur={}, num=0, hits=0, misses=0,
+			tx=tx }
+		table.insert(caches, c)
+		ctx.uv.cache = c
+		ctx.uv.cache_get = cache_get
+		ctx.uv.cache_put = cache_put
+		ctx.uv.cache_check = cache_check
+		ctx.uv.unpack = unpack
+		ctx.buf:putf("local hit = cache_get(cache, %s)\n", table.concat(keys, ", "))
+		ctx.buf:put("if hit then return unpack(hit, 1, hit.n) end\n")
+		frag.pre = ctx.buf:get()
+	end
 	-- query, if any, must happen before any masks are set, because it may create a new instance.
 	if tx.query then
 		local qparams = struct()
@@ -1199,18 +1927,13 @@ local function compiletransaction(tx, graph_instance)
 				qparams.fields[a.output.name] = a.input
 			end
 		end
-		ctx.uv.query_exec = G[tx.query].exec
 		local ctype = G[tx.query].ctype
-		ctx.uv.query_ptrtype = ffi.typeof("$*", ctype)
 		ctx.uv.graph_instance = graph_instance
-		ctx.uv.ffi_cast = ffi.cast
-		ctx.uv.mem_alloc = mem.alloc
 		ctx.query_field = tx.query_field
-		ctx.buf:putf(
-			"local Q = query_exec(graph_instance(), %s, ffi_cast(query_ptrtype, mem_alloc(%d, %d)))\n",
-			next(qparams.fields) and emitread(ctx, qparams) or "nil",
-			ffi.sizeof(ctype), ffi.alignof(ctype)
-		)
+		frag.qparams = next(qparams.fields) and emitread(ctx, qparams) or "nil"
+		ctx.buf:putf("local Q = %s(", ctx.uv[G[tx.query].exec])
+		frag.qpre = ctx.buf:get()
+		frag.qmask = tx.query_mask
 	end
 	for _,a in ipairs(tx.actions) do
 		walk(a.output, visit_mmask, ctx)
@@ -1223,57 +1946,133 @@ local function compiletransaction(tx, graph_instance)
 	end
 	if ctx.mmask then
 		ctx.uv.mem_write = mem.write
-		ctx.buf:putf("mem_write(0x%xull)\n", ctx.mmask)
+		frag.mmask = ctx.mmask
 	end
 	if tx.reset then
+		-- the query may have left resets it doesn't depend on pending, so always merge.
 		ctx.uv.G_state = D.G_state.ptr
-		if tx.query then
-			ctx.buf:putf("G_state.mask = 0x%xull\n", tx.reset)
-		else
-			ctx.uv.bor = bit.bor
-			ctx.buf:putf("G_state.mask = bor(G_state.mask, 0x%xull)\n", tx.reset)
-		end
+		ctx.uv.bor = bit.bor
+		ctx.buf:putf("G_state.mask = bor(G_state.mask, 0x%xull)\n", tx.reset)
 	end
 	local inputs = {}
 	for i,a in ipairs(tx.actions) do
-		if gettag(a.output) ~= "bind" then
+		local tag = gettag(a.output)
+		if tag ~= "bind" and tag ~= "cachekey" then
 			inputs[i] = emitread(ctx, a.input)
 		end
 	end
 	for i,a in ipairs(tx.actions) do
-		if gettag(a.output) ~= "bind" then
+		local tag = gettag(a.output)
+		if tag ~= "bind" and tag ~= "cachekey" then
 			emitwrite(ctx, a.output, inputs[i])
 		end
 	end
+	if keys then
+		ctx.buf:putf("cache_put(cache, cache_check(cache, {n=%d", ctx.nret)
+		for i=1, ctx.nret do
+			ctx.buf:putf(", ret%d", i)
+		end
+		ctx.buf:putf("}), %s)\n", table.concat(keys, ", "))
+	end
+	if tx.query then
+		local ctype = G[tx.query].ctype
+		local ptrtype = ffi.typeof("$*", ctype)
+		if not ctx.call and not isqueryescape(tx, ctype) then
+			local scratch = ffi.new(ffi.typeof("$[1]", ctype))
+			table.insert(query_scratch, scratch)
+			frag.qpost = string.format(", %s, %s)\n", frag.qparams,
+				ctx.uv[ffi.cast(ptrtype, scratch)])
+		else
+			ctx.uv.ffi_cast = ffi.cast
+			ctx.uv.mem_framealloc = mem.framealloc
+			frag.qpost = string.format(", %s, ffi_cast(%s, mem_framealloc(%d, %d)))\n",
+				frag.qparams, ctx.uv[ptrtype], ffi.sizeof(ctype), ffi.alignof(ctype))
+		end
+	end
+	frag.body = ctx.buf:get()
+	frag.narg = ctx.narg
+	frag.nret = ctx.nret
+	frag.call = ctx.call
+	return frag
+end
+
+-- compile a run of fragments into one function.
+-- the instance is refreshed once for all queries up to the next fragment that sets resets
+-- or calls out, and all masks are set by a single mem_write after the first query.
+local function compilefrags(frags, name)
+	local uv = {}
+	local mmask
+	local query = false
+	for _,frag in ipairs(frags) do
+		for k,v in pairs(frag.uv) do uv[k] = v end
+		if frag.mmask then mmask = bit.bor(mmask or 0ull, frag.mmask) end
+		query = query or frag.qpre ~= nil
+	end
+	local narg, nret = frags[1].narg, frags[1].nret
 	local buf = buffer.new()
-	local uv = code.emitupvalues(ctx.uv, buf)
+	local vs = code.emitupvalues(uv, buf)
 	buf:put("return function(")
-	if ctx.narg > 0 then
+	if narg > 0 then
 		buf:put("arg1")
-		for i=2, ctx.narg do
+		for i=2, narg do
 			buf:putf(", arg%d", i)
 		end
 	end
 	buf:put(")\n")
-	buf:put(ctx.buf)
-	if ctx.nret > 0 then
+	if query then
+		buf:put("local I\n")
+	end
+	local fused = #frags > 1
+	local instance = false
+	for i,frag in ipairs(frags) do
+		if fused then buf:put("do\n") end
+		if frag.pre then buf:put(frag.pre) end
+		if frag.qpre then
+			if not instance then
+				local qmask = 0ull
+				for j=i, #frags do
+					qmask = bit.bor(qmask, frags[j].qmask or 0ull)
+					if frags[j].reset or frags[j].call then break end
+				end
+				buf:putf("I = graph_instance(0x%xull)\n", qmask)
+				instance = true
+			end
+			buf:put(frag.qpre, "I", frag.qpost)
+		end
+		if i == 1 and mmask then
+			buf:putf("mem_write(0x%xull)\n", mmask)
+		end
+		buf:put(frag.body)
+		if frag.reset or frag.call then
+			instance = false
+		end
+		if fused then buf:put("end\n") end
+	end
+	if nret > 0 then
 		buf:put("return ret1")
-		for i=2, ctx.nret do
+		for i=2, nret do
 			buf:putf(", ret%d", i)
 		end
 		buf:put("\n")
 	end
 	buf:put("end\n")
-	return load(buf, code.chunkname(string.format("transaction %p", tx)))(unpack(uv))
+	return load(buf, code.chunkname(name))(unpack(vs))
+end
+
+local function compiletransaction(tx, graph_instance, idx)
+	local frag = transactionfrag(tx, graph_instance, idx)
+	return compilefrags({frag}, string.format("transaction %p", tx)), frag
 end
 
--- TODO: this should take a query mask parameter and only create a new instance if the
--- intersection is nonzero
+-- graph_instance(qmask) returns an instance for a query that depends on the resets in `qmask`.
+-- a new instance is only created when one of them is pending, and it applies every pending
+-- reset.
 local function graph_instancefunc(alloc)
 	return load(string.format([[
 		local state, G, alloc, memstate, write, iswritable = ...
-		return function()
-			if state.mask == 0 then
+		local band = bit.band
+		return function(qmask)
+			if band(state.mask, qmask) == 0 then
 				return state.instance
 			end
 			if not iswritable(state.instance) then
@@ -1297,13 +2096,52 @@ local tx_compiled_mt = {
 
 local function compiletransactions(alloc)
 	local graph_instance = graph_instancefunc(alloc)
-	for _,tx in ipairs(D.transactions) do
-		local func = compiletransaction(tx, graph_instance)
+	if profile_path and not M3_WORKER_ID then
+		profile_run = {}
+		for i=1, #D.transactions do profile_run[i] = 0 end
+	end
+	for i,tx in ipairs(D.transactions) do
+		local func, frag = compiletransaction(tx, graph_instance, i)
 		table.clear(tx)
 		setmetatable(tx, tx_compiled_mt).func = func
+		if frag.narg == 0 and frag.nret == 0 then
+			tx.frag = frag
+		end
 	end
 end
 
+-- upvalue limit for fused functions, the vm allows 60.
+local FUSE_MAXUV = 50
+
+-- can the compiled transaction be fused with its neighbours?
+-- only transactions without arguments or return values are, because they can't affect
+-- control flow.
+local function fusable(tx)
+	return tx.frag ~= nil
+end
+
+-- fuse(txs) -> func, n
+-- compile the longest prefix of `txs` that fits in one function. returns the function and the
+-- number of transactions it runs.
+local function fuse(txs)
+	local frags, uv, nuv = {}, {}, 0
+	for i,tx in ipairs(txs) do
+		local frag = tx.frag
+		local new = 0
+		for k in pairs(frag.uv) do
+			if not uv[k] then new = new+1 end
+		end
+		if i > 1 and nuv+new > FUSE_MAXUV then break end
+		for k in pairs(frag.uv) do uv[k] = true end
+		nuv = nuv+new
+		frags[i] = frag
+	end
+	if #frags == 1 then
+		return txs[1].func, 1
+	end
+	return compilefrags(frags, string.format("transactions %p..%p", txs[1], txs[#frags])), #frags
+end
+
 ---- Initialization ------------------------------------------------------------
 
 local function collect(o, all)
@@ -1368,6 +2206,7 @@ local function init()
 		event("data", traceobjs())
 	end
 	compiletransactions(alloc)
+	abuf.alloc = mem.newalloc()
 	code.setupvalue(abuf_commit, "tail", D.actions.tail.ptr)
 	table.clear(D)
 end
@@ -1390,11 +2229,48 @@ local function defined(tab, name, ...)
 	return false
 end
 
+-- files read by include(), for tools that need to know when the model changes.
+local included = {}
+
 -- TODO fhk lexer should support streaming
 local function include(name)
 	local fp = assert(io.open(name, "r"))
 	define(fp:read("*a"))
 	fp:close()
+	table.insert(included, name)
+end
+
+local function sources()
+	return {unpack(included)}
+end
+
+-- layout_profile(path): lay out work memory by the transaction call counts recorded in `path',
+-- and add the counts of this run to it on exit. only the main process records, so record
+-- profiles with a serial run. transactions are matched by where they are defined, and those
+-- that are not in the profile count as never called.
+-- layout_profile(false) stops recording.
+local function layout_profile(path)
+	profile_path = path
+	if not path then return end
+	local fp = io.open(path, "rb")
+	if fp then
+		profile_counts = buffer.decode(fp:read("*a"))
+		fp:close()
+	end
+end
+
+local function profile_save()
+	if not (profile_run and profile_path) or M3_WORKER_ID then return end
+	local counts = {}
+	if profile_counts then
+		for k,n in pairs(profile_counts) do counts[k] = n end
+	end
+	for i,k in ipairs(profile_keys()) do
+		counts[k] = (counts[k] or 0) + profile_run[i]
+	end
+	local fp = assert(io.open(profile_path, "wb"))
+	fp:write(buffer.encode(counts))
+	fp:close()
 end
 
 local function transaction_action(transaction, action)
@@ -1608,6 +2484,7 @@ local function transaction_sql_insert(transaction, tab, values)
 		end
 		dd:put(")")
 		db.ddl(tostring(dd))
+		db.output(tab)
 		return transaction_action(transaction, {
 			input  = splat(args),
 			output = dml(insert, #args)
@@ -1620,6 +2497,20 @@ local function transaction_sql_insert(transaction, tab, values)
 	end
 end
 
+-- col_insert("tab", {col=expr}, [{col=ctype}])
+-- like sql_insert, but appends the rows to the column file, see m3_colfile.
+-- ctype is a C type name or "dict" for a dictionary encoded column. the default is double.
+local function transaction_col_insert(transaction, tab, values, types)
+	local cols, args = {}, {}
+	for col in pairs(values) do table.insert(cols, col) end
+	table.sort(cols)
+	for i,col in ipairs(cols) do args[i] = values[col] end
+	return transaction_action(transaction, {
+		input  = splat(args),
+		output = call(colfile.writer(tab, cols, types), #args, D.actions)
+	})
+end
+
 local function identcol(col)
 	return col
 end
@@ -1754,6 +2645,7 @@ local function transaction_autoselect(transaction, x)
 		selector = function(tab)
 			local where = autoselect_inspect(tab, function(config) return config.where end)
 			local binds = {}
+			local key
 			if where == nil then
 				local auto = autoselect_autowhere(tab, names)
 				if auto then
@@ -1761,7 +2653,9 @@ local function transaction_autoselect(transaction, x)
 					for col,name in pairs(auto) do
 						table.insert(binds, arg(names[name]))
 						table.insert(where, string.format("%s = ?%d", sqlite.escape(col), #binds))
+						key = {col=col, arg=names[name]}
 					end
+					if #binds > 1 then key = nil end
 					where = sqlite.sql("WHERE", unpack(where))
 				end
 			elseif where then
@@ -1777,7 +2671,7 @@ local function transaction_autoselect(transaction, x)
 				where = sqlite.sql("WHERE", where)
 			end
 			return autoselect_rename(tab), where, splat(binds),
-				function(col) return autoselect_rename(tab, col) end
+				function(col) return autoselect_rename(tab, col) end, key
 		end
 	else
 		selector = x
@@ -1787,7 +2681,7 @@ local function transaction_autoselect(transaction, x)
 			local obj = D.mapping[t]
 			local tag = gettag(obj)
 			if tag == "struct" or tag == "dataframe" then
-				local tab, sql, bind, cols = selector(tostring(t.name))
+				local tab, sql, bind, cols, key = selector(tostring(t.name))
 				if tab then
 					local schema = db.schema(tab)
 					if schema then
@@ -1806,7 +2700,7 @@ local function transaction_autoselect(transaction, x)
 							end
 							obj = new
 						end
-						action(bind or splat(), autoselect(obj, tab, sql, cols))
+						action(bind or splat(), autoselect(obj, tab, sql, cols, key))
 					end
 				end
 			end
@@ -1814,6 +2708,36 @@ local function transaction_autoselect(transaction, x)
 	end)
 end
 
+-- transaction_cache({key, ...}, size)
+-- memoize the results of a read-only transaction across tasks, by the values of the keys.
+-- the results must only depend on the keys, which are data reads (memslots, columns,
+-- args with explicit indices, ...), not graph expressions. keys should be numbers, strings or
+-- booleans: cdata keys compare by identity and never hit. there must be at least one key.
+-- results must be plain numbers, strings or booleans, not vectors or other references into
+-- memory. at most `size' (default 1024) results are kept.
+local function transaction_cache(transaction, keys, size)
+	if #keys == 0 then
+		error("cache: expected at least one key")
+	end
+	for _,k in ipairs(keys) do
+		transaction_action(transaction, {
+			input  = k,
+			output = cachekey()
+		})
+	end
+	transaction.m3_cache = size or 1024
+	return transaction
+end
+
+-- cachestats() -> {{hits=..., misses=..., size=...}, ...}, in order of definition
+local function cachestats()
+	local stats = {}
+	for i,c in ipairs(caches) do
+		stats[i] = { hits=c.hits, misses=c.misses, size=c.num + (c.old and c.size or 0) }
+	end
+	return stats
+end
+
 local transaction_mt = {
 	["m3$transaction"] = true,
 	__index = {
@@ -1828,6 +2752,8 @@ local transaction_mt = {
 		call       = transaction_call,
 		sql        = transaction_sql,
 		sql_insert = transaction_sql_insert,
+		col_insert = transaction_col_insert,
+		cache      = transaction_cache,
 		autoselect = transaction_autoselect
 	}
 }
@@ -1835,6 +2761,8 @@ local transaction_mt = {
 local function transaction()
 	local tx = setmetatable({}, transaction_mt)
 	table.insert(D.transactions, tx)
+	local info = debug.getinfo(2, "Sl")
+	table.insert(D.txsource, string.format("%s:%d", info.source:gsub("^@", ""), info.currentline))
 	return tx
 end
 
@@ -1856,8 +2784,17 @@ return {
 	commit        = abuf_commit,
 	transaction   = transaction,
 	istransaction = istransaction,
+	fusable       = fusable,
+	fuse          = fuse,
 	define        = define,
 	defined       = defined,
 	include       = include,
+	sources       = sources,
 	mappers       = autoselect_map,
+	prefetch      = prefetch,
+	snapshot_write = snapshot_write,
+	snapshot_use  = snapshot_use,
+	layout_profile = layout_profile,
+	profile_save  = profile_save,
+	cachestats    = cachestats,
 }
@@ -1,26 +1,73 @@
+local C = require "m3_C"
 local dbg = require "m3_debug"
 local buffer = require "string.buffer"
 local ffi = require "ffi"
 local sqlite = require "sqlite"
+require "table.clear"
 local type = type
+local band, rshift = bit.band, bit.rshift
+local max, min = math.max, math.min
+local istype = ffi.istype
+local int64_t, uint64_t = ffi.typeof("int64_t"), ffi.typeof("uint64_t")
 local sqlite_escape, sqlite_open, sqlite_reflect = sqlite.escape, sqlite.open, sqlite.reflect
 local enabled, event = dbg.enabled, dbg.event
 
--- TODO make these configurable
-local MAX_BACKLOG = 10000
-local BUSY_TIMEOUT = 5000
+-- approximate backlog size of a value, not counting text
+local VALUE_SIZE = ffi.sizeof("uint32_t") + ffi.sizeof("m3_SqlCell")
+
+-- pragma profiles for config{profile=...}
+local PROFILES = {
+	throughput = {
+		journal_mode = "WAL",
+		synchronous  = "NORMAL",
+		cache_size   = -65536,
+		mmap_size    = 268435456,
+		temp_store   = "MEMORY"
+	}
+}
+
+-- pragmas that apply to the connection rather than a single database
+local PRAGMA_CONNECTION = {
+	busy_timeout = true,
+	temp_store   = true
+}
+
+-- the backlog is flushed when it reaches `rows` rows, `bytes` bytes, or `time` seconds since
+-- the first buffered row, whichever comes first.
+-- with `adaptive` set, the row limit is tuned between `minrows` and `maxrows` so that a
+-- commit takes about `latency` seconds.
+local global_config = {
+	rows         = 10000,
+	bytes        = 4*2^20,
+	time         = 1,
+	adaptive     = true,
+	latency      = 0.05,
+	minrows      = 100,
+	maxrows      = 1000000,
+	busy_timeout = 5000,
+	pragma       = {}
+}
+local global_rowlimit = global_config.rows
+local global_bytelimit = global_config.bytes
+local global_timelimit = global_config.time*1e9
+local global_t0 = 0 -- time of the first buffered row
+local global_stats = { flushes=0, rows=0, bytes=0, time=0 }
 
 local global_connection  -- sqlite3 *
 local global_schema -- reflect
 local global_maindb = ":memory:"
-local global_datadef = {} -- list of DDL
+local global_datadef = {} -- list of DDL (string or function() -> string)
+local global_attached = {} -- list of {url=..., name=...}
+local global_outputs = {} -- list of tables created for output, see output()
+local global_outputdbs = {} -- name => true for databases that have output tables
+local global_shard -- worker id when attached databases are sharded
+local global_image -- size of the shared main database image when connecting to it, see image()
 local global_statements = {} -- sql => lazy statement
-
--- i:     statement
--- i+1:   number of bind parameters
--- i+1+j: j'th bind parameter
-local global_backlog = {}
-local global_backlogstate = ffi.new [[ struct { int32_t tail; } ]]
+local global_discard = false -- drop the backlog instead of flushing it?
+local global_sink -- function() that ships the backlog elsewhere instead of flushing it
+local global_backlog = ffi.new("m3_SqlBacklog")
+local global_backlogmem = { entrycap=0, valuecap=0 } -- anchors the backlog arrays
+local global_anchor = {} -- value index => string referenced by the backlog
 
 ---- Database management -------------------------------------------------------
 
@@ -30,16 +77,104 @@ local function ddl(sql)
 	end
 end
 
+-- with sharding enabled, each worker attaches its own file `<url>.<worker>` instead of `url`.
+-- the worker id goes on the path, before the query parameters of a `file:' uri.
+local function shardurl(url)
+	if global_shard and url ~= ":memory:" and url ~= "" then
+		local path, query = url:match("^([^?]*)(.*)$")
+		return string.format("%s.%d%s", path, global_shard, query)
+	else
+		return url
+	end
+end
+
 local function attach(url, name)
 	if name == "main" or not name then
 		global_maindb = url
 	else
-		ddl(string.format("ATTACH DATABASE '%s' AS %s", sqlite_escape(url), sqlite_escape(name)))
+		table.insert(global_attached, {url=url, name=name})
+		ddl(function()
+			return string.format("ATTACH DATABASE '%s' AS %s", sqlite_escape(shardurl(url)),
+				sqlite_escape(name))
+		end)
+	end
+end
+
+local function attached()
+	return global_attached
+end
+
+-- file level pragmas of the profile only go to databases with output tables. input databases
+-- and the read-only image are never changed.
+local function dbpragma(sql, name)
+	for pname,value in pairs(global_config.pragma) do
+		if not PRAGMA_CONNECTION[pname] then
+			sql:putf("PRAGMA %s.%s=%s;\n", sqlite_escape(name), pname, value)
+		end
 	end
 end
 
+-- output(tab): record that `tab` is created for output, so that image_create() can refuse
+-- output tables in the read-only main database, and the database gets the file level pragmas.
+local function output(tab)
+	table.insert(global_outputs, tab)
+	local name = tab:match("^([^.]+)%.") or "main"
+	if not global_outputdbs[name] then
+		global_outputdbs[name] = true
+		if global_connection then
+			local sql = buffer.new()
+			dbpragma(sql, name)
+			if #sql > 0 then global_connection:execscript(tostring(sql)) end
+		end
+	end
+end
+
+-- url of the main database, even when connected to its image.
+local function maindb()
+	return global_maindb
+end
+
+-- shard(id): from now on, connect to per-worker copies of attached databases.
+local function shard(id)
+	global_shard = id
+end
+
+-- the main database image registered by image_create().
+local IMAGE_NAME = "m3main"
+
 local function connection_info()
-	return global_maindb, table.concat(global_datadef, ";\n")
+	if global_image then
+		-- the image already has the schema, only reattach the other databases.
+		local dd = {}
+		for _,def in ipairs(global_datadef) do
+			if type(def) == "function" then table.insert(dd, def()) end
+		end
+		table.insert(dd, string.format("PRAGMA main.mmap_size=%d", global_image))
+		return string.format("file:%s?vfs=m3img&immutable=1", IMAGE_NAME), table.concat(dd, ";\n")
+	end
+	local dd = {}
+	for i,def in ipairs(global_datadef) do
+		dd[i] = type(def) == "function" and def() or def
+	end
+	return global_maindb, table.concat(dd, ";\n")
+end
+
+local function pragma(con)
+	local sql = buffer.new()
+	if global_config.busy_timeout then
+		sql:putf("PRAGMA busy_timeout=%d;\n", global_config.busy_timeout)
+	end
+	for name,value in pairs(global_config.pragma) do
+		if PRAGMA_CONNECTION[name] then
+			sql:putf("PRAGMA %s=%s;\n", name, value)
+		end
+	end
+	for name in pairs(global_outputdbs) do
+		dbpragma(sql, name)
+	end
+	if #sql > 0 then
+		con:execscript(tostring(sql))
+	end
 end
 
 local function connection()
@@ -47,13 +182,55 @@ local function connection()
 		local url, dd = connection_info()
 		global_connection = sqlite_open(url)
 		global_connection:execscript(dd)
-		if BUSY_TIMEOUT then
-			global_connection:execscript(string.format("PRAGMA busy_timeout=%d", BUSY_TIMEOUT))
-		end
+		pragma(global_connection)
 	end
 	return global_connection
 end
 
+-- config {
+--     rows=..., bytes=..., time=..., adaptive=..., latency=..., minrows=..., maxrows=...,
+--     busy_timeout=..., profile="throughput", pragma={name=value, ...}
+-- }
+-- pragmas that aren't per connection only apply to databases with output tables, see output().
+local function config(opt)
+	for k,v in pairs(opt) do
+		if k == "profile" then
+			local profile = PROFILES[v]
+			if not profile then
+				error(string.format("unknown database profile: `%s'", v), 2)
+			end
+			for name,value in pairs(profile) do
+				global_config.pragma[name] = value
+			end
+		elseif k == "pragma" then
+			for name,value in pairs(v) do
+				global_config.pragma[name] = value
+			end
+		elseif global_config[k] == nil then
+			error(string.format("unknown database option: `%s'", k), 2)
+		else
+			global_config[k] = v
+		end
+	end
+	global_rowlimit = global_config.rows
+	global_bytelimit = global_config.bytes
+	global_timelimit = global_config.time*1e9
+	if global_connection then
+		pragma(global_connection)
+	end
+end
+
+-- per-process output counters. `batch` is the current row limit.
+local function stats()
+	return {
+		flushes = global_stats.flushes,
+		rows    = global_stats.rows,
+		bytes   = global_stats.bytes,
+		time    = global_stats.time,
+		batch   = global_rowlimit
+	}
+end
+
 -- schema() -> refl
 -- schema(tab) -> refl[tab]
 local function schema(tab)
@@ -69,137 +246,334 @@ end
 
 ---- Backlog -------------------------------------------------------------------
 
--- scalar statement or vector statement head:
---   [base]              sqlite3_stmt
---   [base+1]            ncol (number of arguments to the statement)
---   [base+1+i]          i'th bind arg  (i=1,...,narg)
--- vector statement tail:
---   [base]              nvcol (number of vector arguments)
---   [base+1]            nvrow (number of vector rows)
---   [base+1+i]          i'th vector argument index  (i=1,...,narg)
---   [base+1+nvcol*j+i]  i'th vector arg of j'th row
-
-local function backlog_throw(base, msg, level)
+-- the backlog is a typed columnar buffer (m3_SqlBacklog, see sql.c) that is flushed in C.
+-- entry i:
+--   stmt                                 sqlite3_stmt
+--   narg                                 number of bind values
+--   nvcol                                number of vector arguments
+--   nrow                                 number of vector rows after the first
+-- values of entry i:
+--   [base+j]                             j'th bind value (j=0,...,narg-1)
+--   [base+narg+k]                        parameter index of k'th vector argument
+--   [base+narg+nvcol*r+k]                k'th vector argument on r'th extra row (r=1,...,nrow)
+
+local function backlog_sql(stmt)
+	return ffi.string(C.sqlite3_sql(stmt))
+end
+
+local function backlog_value(idx)
+	local tag = global_backlog.tag[idx]
+	local t = band(tag, C.M3_SQL_TAGMASK)
+	if t == C.M3_SQL_DOUBLE then
+		return global_backlog.cell[idx].f
+	elseif t == C.M3_SQL_INT then
+		return global_backlog.cell[idx].i
+	elseif t == C.M3_SQL_TEXT then
+		return ffi.string(global_backlog.cell[idx].p, rshift(tag, 2))
+	end
+end
+
+local function backlog_put(idx, v)
+	local backlog = global_backlog
+	if type(v) == "number" then
+		backlog.tag[idx] = C.M3_SQL_DOUBLE
+		backlog.cell[idx].f = v
+	elseif type(v) == "string" then
+		-- the backlog points into the string, it must stay alive until the flush.
+		global_anchor[idx] = v
+		backlog.tag[idx] = C.M3_SQL_TEXT + 4*#v
+		backlog.text = backlog.text + #v
+		backlog.cell[idx].p = v
+	elseif v == nil then
+		backlog.tag[idx] = C.M3_SQL_NULL
+	elseif type(v) == "boolean" then
+		backlog.tag[idx] = C.M3_SQL_INT
+		backlog.cell[idx].i = v and 1 or 0
+	elseif istype(int64_t, v) or istype(uint64_t, v) then
+		backlog.tag[idx] = C.M3_SQL_INT
+		backlog.cell[idx].i = v
+	else
+		backlog.tag[idx] = C.M3_SQL_DOUBLE
+		backlog.cell[idx].f = tonumber(v)
+	end
+end
+
+local function backlog_args(e)
+	local args = {}
+	for i=1, e.narg do
+		args[i] = backlog_value(e.base+i-1)
+	end
+	return args
+end
+
+local function backlog_throw(msg, level, stmt, ...)
 	local buf = buffer.new():put(msg)
-	buf:put("\n\tquery: ", global_backlog[base]:sql())
-	for i=1, global_backlog[base+1] do
-		buf:putf("\n\targ #%d: %s", i, global_backlog[base+1+i])
+	buf:put("\n\tquery: ", backlog_sql(stmt))
+	for i=1, select("#", ...) do
+		buf:putf("\n\targ #%d: %s", i, (select(i, ...)))
 	end
 	error(tostring(buf), level)
 end
 
-local function backlog_flush()
-	local tail = global_backlogstate.tail
+local function backlog_clear()
+	global_backlog.nentry = 0
+	global_backlog.nvalue = 0
+	global_backlog.rows = 0
+	global_backlog.text = 0
+	table.clear(global_anchor)
+end
+
+local function backlog_grow(nentry, nvalue)
 	local backlog = global_backlog
-	global_backlogstate.tail = 0
-	local idx = 0
-	global_statements.BEGIN.sqlite3_stmt:exec()
-	local stmt
-	while idx < tail do
-		local v = backlog[idx]
-		if type(v) == "cdata" then
-			-- it's a new statement
-			stmt = v
-			local narg = backlog[idx+1]
-			for i=1, narg do
-				stmt:bind(i, backlog[idx+1+i])
-			end
-			if enabled("sql") then
-				event("sql", stmt, unpack(backlog, idx+2, idx+1+narg))
-			end
-			if stmt:step() then
-				stmt:reset()
-			end
-			idx = idx+2+narg
-		else
-			-- it's the tail part of a vectorized insert
-			local nvcol = v
-			local nvrow = backlog[idx+1]
-			for j=1, nvrow do
-				for i=1, nvcol do
-					stmt:bind(backlog[idx+1+i], backlog[idx+1+nvcol*j+i])
-				end
-				-- TODO: sql event (need scalar values from previous statement)
-				if stmt:step() then
-					stmt:reset()
-				end
+	local mem = global_backlogmem
+	if nentry > mem.entrycap then
+		local cap = math.max(2*mem.entrycap, nentry, 64)
+		local entry = ffi.new("m3_SqlEntry[?]", cap)
+		ffi.copy(entry, backlog.entry, backlog.nentry*ffi.sizeof("m3_SqlEntry"))
+		mem.entry, mem.entrycap, backlog.entry = entry, cap, entry
+	end
+	if nvalue > mem.valuecap then
+		local cap = math.max(2*mem.valuecap, nvalue, 256)
+		local tag = ffi.new("uint32_t[?]", cap)
+		local cell = ffi.new("m3_SqlCell[?]", cap)
+		ffi.copy(tag, backlog.tag, backlog.nvalue*ffi.sizeof("uint32_t"))
+		ffi.copy(cell, backlog.cell, backlog.nvalue*ffi.sizeof("m3_SqlCell"))
+		mem.tag, mem.cell, mem.valuecap, backlog.tag, backlog.cell = tag, cell, cap, tag, cell
+	end
+end
+
+-- append an entry with room for `nvalue` values, returns the index of its first value.
+local function backlog_entry(stmt, narg, nvalue)
+	local backlog = global_backlog
+	local e, base = backlog.nentry, backlog.nvalue
+	if e >= global_backlogmem.entrycap or base+nvalue > global_backlogmem.valuecap then
+		backlog_grow(e+1, base+nvalue)
+	end
+	if e == 0 then
+		global_t0 = C.m3_sys_time_ns()
+	end
+	local entry = backlog.entry+e
+	entry.stmt = stmt
+	entry.base = base
+	entry.narg = narg
+	entry.nvcol = 0
+	entry.nrow = 0
+	backlog.nentry = e+1
+	backlog.nvalue = base+nvalue
+	backlog.rows = backlog.rows+1
+	return base
+end
+
+local function backlog_trace()
+	local backlog = global_backlog
+	for i=0, backlog.nentry-1 do
+		local e = backlog.entry[i]
+		local sql, args = backlog_sql(e.stmt), backlog_args(e)
+		event("sql", sql, unpack(args, 1, e.narg))
+		-- extra vector rows replace the vector arguments of the first row.
+		local param = e.base+e.narg
+		for r=1, e.nrow do
+			for k=0, e.nvcol-1 do
+				args[tonumber(backlog.cell[param+k].i)] = backlog_value(param+e.nvcol*r+k)
 			end
-			idx = idx+2+(nvrow+1)*nvcol
+			event("sql", sql, unpack(args, 1, e.narg))
 		end
 	end
+end
+
+-- grow the batch while commits are fast, shrink it when they hold the write lock too long.
+local function backlog_adapt(rows, dt)
+	local latency = global_config.latency
+	if dt > 2*latency then
+		global_rowlimit = max(math.floor(global_rowlimit/2), global_config.minrows)
+	elseif dt < latency/2 and rows >= global_rowlimit then
+		global_rowlimit = min(2*global_rowlimit, global_config.maxrows)
+	end
+end
+
+local function backlog_commit()
+	if enabled("sql") then
+		backlog_trace()
+	end
+	global_statements.BEGIN.sqlite3_stmt:exec()
+	local r = C.m3_sql_flush(global_backlog)
+	if r ~= 0 then
+		local e = global_backlog.entry[global_backlog.fail]
+		local stmt = e.stmt
+		local msg = ffi.string(C.sqlite3_errmsg(C.sqlite3_db_handle(stmt)))
+		local args = backlog_args(e)
+		backlog_clear()
+		backlog_throw(msg, 4, stmt, unpack(args, 1, e.narg))
+	end
+	backlog_clear()
 	global_statements.COMMIT.sqlite3_stmt:exec()
 end
 
+local function backlog_flush()
+	if global_discard then
+		return backlog_clear()
+	end
+	local backlog = global_backlog
+	local rows = backlog.rows
+	local bytes = VALUE_SIZE*backlog.nvalue + backlog.text
+	local t = C.m3_sys_time_ns()
+	if global_sink then
+		global_sink()
+	else
+		backlog_commit()
+	end
+	local dt = tonumber(C.m3_sys_time_ns() - t)/1e9
+	global_stats.flushes = global_stats.flushes+1
+	global_stats.rows = global_stats.rows+rows
+	global_stats.bytes = global_stats.bytes+bytes
+	global_stats.time = global_stats.time+dt
+	if global_config.adaptive and not global_sink then
+		backlog_adapt(rows, dt)
+	end
+end
+
 local function backlog_check()
-	if global_backlogstate.tail >= MAX_BACKLOG then
+	local backlog = global_backlog
+	if backlog.rows >= global_rowlimit
+		or VALUE_SIZE*backlog.nvalue + backlog.text >= global_bytelimit
+		or (band(backlog.nentry, 0x3f) == 0 and C.m3_sys_time_ns()-global_t0 >= global_timelimit)
+	then
 		backlog_flush()
 	end
 end
 
-local function backlog_expandvec(base)
-	local backlog = global_backlog
-	local narg = backlog[base+1]
-	local vbase = base+2+narg
+local function isvec(v)
+	return type(v) == "table" or type(v) == "cdata"
+end
+
+local function backlog_vec(stmt, ...)
+	local narg = select("#", ...)
 	local nvcol = 0
 	local nrow
 	for i=1, narg do
-		local v = backlog[base+1+i]
-		if type(v) == "table" or type(v) == "cdata" then
+		local v = select(i, ...)
+		if isvec(v) then
 			nvcol = nvcol+1
-			backlog[vbase+1+nvcol] = i
 			if not nrow then
 				nrow = #v
-			else
-				if #v ~= nrow then
-					backlog_throw(base, "vector argument length mismatch", 3)
-				end
+			elseif #v ~= nrow then
+				backlog_throw("vector argument length mismatch", 4, stmt, ...)
 			end
 		end
 	end
 	if nrow == 0 then
-		global_backlogstate.tail = base
 		return
 	end
-	local nvrow = nrow-1
-	backlog[vbase] = nvcol
-	backlog[vbase+1] = nvrow
-	for i=1, nvcol do
-		local argi = backlog[vbase+1+i]
-		local argv = backlog[base+1+argi]
-		local arg0 = type(argv) == "table" and 1 or 0
-		backlog[base+1+argi] = argv[arg0]
-		for j=1, nvrow do
-			backlog[vbase+1+nvcol*j+i] = argv[arg0+j]
+	local base = backlog_entry(stmt, narg, narg+nvcol*nrow)
+	local backlog = global_backlog
+	local entry = backlog.entry+(backlog.nentry-1)
+	entry.nvcol = nvcol
+	entry.nrow = nrow-1
+	backlog.rows = backlog.rows+nrow-1
+	local k = 0
+	for i=1, narg do
+		local v = select(i, ...)
+		if isvec(v) then
+			local v0 = type(v) == "table" and 1 or 0
+			backlog_put(base+i-1, v[v0])
+			backlog.tag[base+narg+k] = C.M3_SQL_INT
+			backlog.cell[base+narg+k].i = i
+			for j=1, nrow-1 do
+				backlog_put(base+narg+nvcol*j+k, v[v0+j])
+			end
+			k = k+1
+		else
+			backlog_put(base+i-1, v)
 		end
 	end
-	global_backlogstate.tail = vbase+2+(nvrow+1)*nvcol
+	backlog_check()
 end
 
 local backlog_func = setmetatable({}, {
 	__index = function(self, n)
 		local buf = buffer.new()
-		buf:put("local type, backlog, backlogstate, backlog_check, backlog_expandvec = type, ...\n")
+		buf:put("local type, backlog_entry, backlog_put, backlog_vec, backlog_check = type, ...\n")
 		buf:put("return function(stmt")
 		for i=1, n do buf:putf(", p%d", i) end
 		buf:put(")\n")
-		buf:putf("local idx = backlogstate.tail backlogstate.tail = idx+%d\n", n+2)
-		buf:putf("backlog[idx] = stmt.sqlite3_stmt backlog[idx+1] = %d\n", n)
-		for i=1, n do buf:putf("backlog[idx+%d] = p%d\n", i+1, i) end
 		if n>0 then
 			buf:put("if ")
 			for i=1, n do
 				if i>1 then buf:put(" or ") end
 				buf:putf("type(p%d) == 'table' or type(p%d) == 'cdata'", i, i)
 			end
-			buf:put("then backlog_expandvec(idx) end\n")
+			buf:put(" then return backlog_vec(stmt.sqlite3_stmt")
+			for i=1, n do buf:putf(", p%d", i) end
+			buf:put(") end\n")
 		end
+		buf:putf("local base = backlog_entry(stmt.sqlite3_stmt, %d, %d)\n", n, n)
+		for i=1, n do buf:putf("backlog_put(base+%d, p%d)\n", i-1, i) end
 		buf:put("backlog_check()\nend\n")
-		local func = load(buf)(global_backlog, global_backlogstate, backlog_check, backlog_expandvec)
+		local func = load(buf)(backlog_entry, backlog_put, backlog_vec, backlog_check)
 		self[n] = func
 		return func
 	end
 })
 
+-- encode the backlog into a string buffer and clear it.
+-- each entry is encoded as:
+--   sql, narg, nvcol, nrow, value_1, ..., value_(narg+nvcol*(nrow+1))
+local function backlog_encode(buf)
+	local backlog = global_backlog
+	for i=0, backlog.nentry-1 do
+		local e = backlog.entry[i]
+		local base, narg, nvcol, nrow = e.base, e.narg, e.nvcol, e.nrow
+		buf:encode(backlog_sql(e.stmt)):encode(narg):encode(nvcol):encode(nrow)
+		for idx=base, base+narg+nvcol*(nrow+1)-1 do
+			buf:encode(backlog_value(idx))
+		end
+	end
+	backlog_clear()
+end
+
+local statement
+local decoder = buffer.new()
+
+-- append statements encoded by backlog_encode() to the backlog.
+local function backlog_decode(ptr, len)
+	decoder:set(ptr, len)
+	while #decoder > 0 do
+		local stmt = statement(decoder:decode()).sqlite3_stmt
+		local narg = decoder:decode()
+		local nvcol = decoder:decode()
+		local nrow = decoder:decode()
+		local nvalue = narg+nvcol*(nrow+1)
+		local base = backlog_entry(stmt, narg, nvalue)
+		local entry = global_backlog.entry+(global_backlog.nentry-1)
+		entry.nvcol = nvcol
+		entry.nrow = nrow
+		global_backlog.rows = global_backlog.rows+nrow
+		for idx=base, base+nvalue-1 do
+			backlog_put(idx, decoder:decode())
+		end
+		backlog_check()
+	end
+end
+
+local function flush()
+	if global_backlog.nentry > 0 then
+		backlog_flush()
+	end
+end
+
+-- sink(f): flush the backlog by calling f() instead of writing it to the database.
+-- f is expected to call backlog_encode().
+local function sink(f)
+	global_sink = f
+end
+
+-- discard(true):  start dropping buffered statements instead of writing them.
+-- discard(false): drop anything buffered so far and resume writing.
+local function discard(flag)
+	backlog_clear()
+	global_discard = flag
+end
+
 ---- Lazy statements -----------------------------------------------------------
 
 local function stmt_buffer(stmt, ...)
@@ -229,7 +603,7 @@ local function newstatement(sql)
 	return setmetatable({sql=sql}, uncompiled_mt)
 end
 
-local function statement(sql)
+function statement(sql)
 	sql = sqlite.stringify(sql)
 	local stmt = global_statements[sql]
 	if not stmt then
@@ -254,7 +628,7 @@ end
 
 local function disconnect(force)
 	if global_connection then
-		if global_backlogstate.tail > 0 then
+		if global_backlog.nentry > 0 then
 			backlog_flush()
 		end
 		if force == false and ismemory() then return end
@@ -271,14 +645,78 @@ local function disconnect(force)
 	end
 end
 
+-- image_create() -> size
+-- map the main database read-only and register it as a shared image. call this in the host
+-- before forking, so that the workers share the mapping. an in-memory main database is copied
+-- into a temporary file first.
+local function image_create()
+	local con = connection()
+	flush()
+	-- the workers only reattach the other databases, and don't rerun the string DDL. the DDL's
+	-- effects on attached database files carry over, but anything that lives in the host's
+	-- connection doesn't.
+	for _,tab in ipairs(global_outputs) do
+		local schema = tab:match("^([^.]+)%.")
+		if not schema or schema == "main" then
+			error(string.format("output table `%s' is in the main database, which is read-only "
+				.. "with a shared database image: put it in an attached database", tab), 0)
+		end
+	end
+	for _,a in ipairs(global_attached) do
+		if a.url == ":memory:" or a.url == "" or a.url:match("[?&]mode=memory") then
+			error(string.format("attached database `%s' is in memory, which can't be shared "
+				.. "with the workers of a shared database image", a.name), 0)
+		end
+	end
+	if con:row("SELECT COUNT(*) FROM temp.sqlite_master")[1] ~= 0 then
+		error("temp objects can't be shared with the workers of a shared database image", 0)
+	end
+	local path = global_maindb
+	local tmp
+	if path == ":memory:" or path == "" then
+		tmp = os.tmpname()
+		os.remove(tmp)
+		con:execscript(string.format("VACUUM INTO '%s'", sqlite_escape(tmp)))
+		path = tmp
+	else
+		con:execscript("PRAGMA main.wal_checkpoint(TRUNCATE)")
+	end
+	local map = ffi.new("void *[1]")
+	local size = ffi.new("size_t[1]")
+	C.check(C.m3_mem_map_file(C.err, path, map, size))
+	if tmp then os.remove(tmp) end
+	C.check(C.m3_sql_image(C.err, IMAGE_NAME, map[0], size[0]))
+	return tonumber(size[0])
+end
+
+-- image(size): from now on, connect to the image registered by image_create() instead of the
+-- main database. the image is read-only, output must go to attached databases.
+local function image(size)
+	disconnect(true)
+	global_image = size
+end
+
 --------------------------------------------------------------------------------
 
 return {
 	connection      = connection,
 	connection_info = connection_info,
 	attach          = attach,
+	config          = config,
+	stats           = stats,
+	attached        = attached,
+	output          = output,
+	maindb          = maindb,
+	shard           = shard,
+	image_create    = image_create,
+	image           = image,
 	ddl             = ddl,
 	schema          = schema,
 	disconnect      = disconnect,
+	discard         = discard,
+	flush           = flush,
+	sink            = sink,
+	encode          = backlog_encode,
+	decode          = backlog_decode,
 	statement       = statement,
 }
@@ -316,8 +316,8 @@ local function trace_mask(mask)
 	trace(string.format("MASK    {%s}", mask2str(mask)))
 end
 
-local function trace_sql(stmt, ...)
-	trace(string.format("SQL     %s %s", stmt:sql(), vpretty("s", "\t", ...)))
+local function trace_sql(sql, ...)
+	trace(string.format("SQL     %s %s", sql, vpretty("s", "\t", ...)))
 end
 
 local function trace_code(code, name)
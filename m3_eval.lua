@@ -1,6 +1,11 @@
+local code = require "m3_code"
+local colfile = require "m3_colfile"
+local control = require "m3_control"
 local data = require "m3_data"
 local db = require "m3_db"
 local dbg = require "m3_debug"
+local mem = require "m3_mem"
+local ring = require "m3_ring"
 local ffi = require "ffi"
 local buffer = require "string.buffer"
 local type = type
@@ -11,6 +16,27 @@ local function init()
 	require "m3_init"
 end
 
+-- warmup(true):  take a savepoint and stop writing output.
+-- warmup(false): go back to the savepoint and throw away any output produced since.
+-- the host uses this to run sample tasks before forking, so that the workers inherit the
+-- compiled traces but none of the side effects.
+local warmup_fp
+local function warmup(on)
+	if on then
+		warmup_fp = mem.save()
+		db.discard(true)
+		colfile.discard(true)
+	else
+		db.discard(false)
+		colfile.discard(false)
+		ring.rollback()
+		mem.load(warmup_fp)
+		mem.delete(warmup_fp)
+		warmup_fp = nil
+		collectgarbage()
+	end
+end
+
 -- spicy APIs that shouldn't be exposed directly to scripts go here.
 local env = setmetatable({
 	m3 = {
@@ -19,8 +45,18 @@ local env = setmetatable({
 		schema          = db.schema,
 		statement       = db.statement,
 		connection_info = db.connection_info,
+		sources         = data.sources,
+		prefetch        = data.prefetch,
+		snapshot_write  = data.snapshot_write,
+		snapshot_use    = data.snapshot_use,
+		sqlstats        = db.stats,
+		rings           = ring.schema,
+		ringdrain       = ring.drain,
 		settrace        = dbg.settrace,
-		init            = init
+		flatten         = control.flatten,
+		code_cache      = code.cache,
+		init            = init,
+		warmup          = warmup
 	}
 }, {__index=_G})
 
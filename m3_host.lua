@@ -8,6 +8,9 @@ local ffi_cast, ffi_copy = ffi.cast, ffi.copy
 package.preload["m3.sqlite"] = function() return bcload("sqlite")(C) end
 package.preload["m3.cli"] = function() return bcload("m3_cli")(C) end
 
+local sqlite = require "m3.sqlite"
+local sqlite_escape = sqlite.escape
+
 ---- Environments --------------------------------------------------------------
 
 -- these are temporary buffers, do not store anything here that lives across calls
@@ -165,6 +168,14 @@ local function serial_flush(serial)
 	end
 	table.clear(serial.pending)
 	serial.n_pending = 0
+	for i=1, #serial.rings do
+		local r = serial.rings[i]
+		local ptr, num = env_eval(serial.L, serial.ringdrain, r.name)
+		local f = serial.consumers[r.name]
+		if f and num > 0 then
+			f(ffi_cast(r.ptype, ptr), num)
+		end
+	end
 end
 
 local function serial_eval(serial, src, ...)
@@ -188,20 +199,67 @@ local function serial_close(serial)
 	env_close(serial.L)
 end
 
+-- consume(name, f): f(ptr, num) is called with records of result ring `name`.
+-- records of rings without a consumer are dropped.
+local function pool_consume(pool, name, f)
+	for _,r in ipairs(pool.rings) do
+		if r.name == name then
+			pool.consumers[name] = f
+			return pool
+		end
+	end
+	error(string.format("no such result ring: `%s'", name))
+end
+
+-- a serial pool has exactly one worker.
+local function serial_evalon(serial, i, ...)
+	if i ~= 1 then
+		error(string.format("no such worker: %s", i))
+	end
+	return serial_eval(serial, ...)
+end
+
+local function serial_broadcast(serial, ...)
+	return { serial_eval(serial, ...) }
+end
+
+-- output counters of each worker, see m3_db.stats
+local function serial_sqlstats(serial)
+	serial_flush(serial)
+	return { (env_eval(serial.L, "return m3.sqlstats()")) }
+end
+
 local serial_mt = {
-	eval  = serial_eval,
-	func  = serial_func,
-	close = serial_close,
-	type  = "serial"
+	eval      = serial_eval,
+	evalon    = serial_evalon,
+	broadcast = serial_broadcast,
+	func      = serial_func,
+	sqlstats  = serial_sqlstats,
+	consume   = pool_consume,
+	close     = serial_close,
+	parallel  = 1,
+	type      = "serial"
 }
 serial_mt.__index = serial_mt
 
+-- ring schema -> {name=..., ptype=...}
+local function ringtypes(L)
+	local rings = {}
+	for _,r in ipairs(env_eval(L, "return m3.rings()")) do
+		table.insert(rings, {name=r.name, stride=r.stride, ptype=ffi.typeof("$ *", ffi.typeof(r.decl))})
+	end
+	return rings
+end
+
 local function serial_new(L)
 	return setmetatable({
 		L         = L,
 		encoder   = buffer.new(),
 		n_pending = 0,
-		pending   = {}
+		pending   = {},
+		rings     = ringtypes(L),
+		ringdrain = env_func(L, "return m3.ringdrain"),
+		consumers = {}
 	}, serial_mt)
 end
 
@@ -247,8 +305,177 @@ end
 	assert(flush == SERIAL_FLUSH)
 end
 
+---- Sharded output ------------------------------------------------------------
+
+-- with sharding enabled, each fork worker writes its own copy of every attached database
+-- (see m3_db.shard), and the host merges the copies into the real databases after the workers
+-- have closed them.
+
+local function sql_quote(name)
+	return '"' .. string.gsub(name, '"', '""') .. '"'
+end
+
+-- returns the file name and the url of worker `i`'s shard of `url`, see m3_db.shardurl.
+local function shard_path(url, i)
+	local path, query = url:match("^([^?]*)(.*)$")
+	path = string.format("%s.%d", path, i)
+	local file = path
+	if file:sub(1,5) == "file:" then
+		file = file:sub(6):gsub("^//[^/]*", "")
+	end
+	return file, path..query
+end
+
+local function shard_exists(file)
+	local fp = io.open(file, "rb")
+	if fp then fp:close() return true end
+	return false
+end
+
+local function shard_remove(file)
+	for _,suffix in ipairs { "", "-journal", "-wal", "-shm" } do
+		os.remove(file..suffix)
+	end
+end
+
+local function sql_column(con, sql, col)
+	local out = {}
+	for row in con:rows(sql) do
+		table.insert(out, (select(col, row:unpack())))
+	end
+	return out
+end
+
+-- returns the name of the column of shard table `qname` that is an alias of the rowid, if any.
+local function shard_rowidalias(con, qname)
+	local pk = {}
+	for row in con:rows(string.format("PRAGMA m3_shard.table_info(%s)", qname)) do
+		local _, name, type, _, _, k = row:unpack()
+		if k > 0 then table.insert(pk, {name=name, type=type}) end
+	end
+	if #pk ~= 1 or pk[1].type:upper() ~= "INTEGER" then return end
+	for _,origin in ipairs(sql_column(con, string.format("PRAGMA m3_shard.index_list(%s)", qname), 4)) do
+		-- WITHOUT ROWID table
+		if origin == "pk" then return end
+	end
+	return pk[1].name
+end
+
+-- prepare the target for table `name` and return where to insert the shard rows.
+-- the target's indexes are dropped here and recreated after all rows are in.
+local function shard_target(con, merge, name, sql)
+	local qname = sql_quote(name)
+	-- every shard numbers the rowid from 1, so the rows of different shards would collide.
+	local alias = shard_rowidalias(con, qname)
+	if alias then
+		error(string.format("can't merge sharded table `%s': its INTEGER PRIMARY KEY `%s' is "
+			.. "numbered per shard. use another key, or output without sharding.", name, alias), 0)
+	end
+	local exists = #sql_column(con, string.format(
+		"SELECT 1 FROM main.sqlite_master WHERE type='table' AND name='%s'", sqlite_escape(name)), 1) > 0
+	if exists then
+		for _,row in ipairs(sql_column(con, string.format(
+			"SELECT name FROM main.sqlite_master WHERE type='index' AND tbl_name='%s' AND sql IS NOT NULL",
+			sqlite_escape(name)), 1)) do
+			if not merge.indexes[row] then
+				merge.indexes[row] = sql_column(con, string.format(
+					"SELECT sql FROM main.sqlite_master WHERE name='%s'", sqlite_escape(row)), 1)[1]
+				table.insert(merge.indexorder, row)
+			end
+			con:execscript(string.format("DROP INDEX main.%s", sql_quote(row)))
+		end
+	else
+		con:execscript(sql)
+	end
+	if merge.order then
+		local cols = sql_column(con, string.format("PRAGMA m3_shard.table_info(%s)", qname), 2)
+		for _,c in ipairs(cols) do
+			if c == merge.order then
+				-- stage the rows so that they can be inserted in order once all shards are in.
+				local stage = string.format("m3_merge_%d", #merge.staged+1)
+				con:execscript(string.format("CREATE TEMP TABLE %s AS SELECT * FROM main.%s WHERE 0",
+					stage, qname))
+				table.insert(merge.staged, {table=qname, stage=stage})
+				return "temp."..stage
+			end
+		end
+	end
+	return "main."..qname
+end
+
+-- merge shards into `url`. shards: list of {file=..., url=...}.
+-- order: column name. if given, rows of tables with that column are inserted in the order of
+-- the column rather than shard by shard. rows with equal keys keep their order within a shard.
+local function shard_merge(url, shards, order)
+	local con = sqlite.open(url)
+	con:execscript("PRAGMA busy_timeout=60000; PRAGMA cache_size=-65536")
+	local merge = { order=order, targets={}, indexes={}, indexorder={}, staged={} }
+	for _,shard in ipairs(shards) do
+		-- ATTACH can't run inside a transaction, so each shard is merged in its own transaction.
+		con:execscript(string.format("ATTACH DATABASE '%s' AS m3_shard", sqlite_escape(shard.url)))
+		local objs = {}
+		for row in con:rows([[
+			SELECT type, name, sql FROM m3_shard.sqlite_master
+			WHERE sql IS NOT NULL AND name NOT LIKE 'sqlite_%'
+			ORDER BY type = 'index'
+		]]) do
+			table.insert(objs, {row:unpack()})
+		end
+		con:execscript("BEGIN")
+		for _,o in ipairs(objs) do
+			local type, name, sql = o[1], o[2], o[3]
+			if type == "table" then
+				if not merge.targets[name] then
+					merge.targets[name] = shard_target(con, merge, name, sql)
+				end
+				con:execscript(string.format("INSERT INTO %s SELECT * FROM m3_shard.%s",
+					merge.targets[name], sql_quote(name)))
+			elseif type == "index" and not merge.indexes[name] then
+				merge.indexes[name] = sql
+				table.insert(merge.indexorder, name)
+			end
+		end
+		con:execscript("COMMIT")
+		con:execscript("DETACH DATABASE m3_shard")
+	end
+	con:execscript("BEGIN")
+	for _,s in ipairs(merge.staged) do
+		con:execscript(string.format("INSERT INTO main.%s SELECT * FROM temp.%s ORDER BY %s, rowid",
+			s.table, s.stage, sql_quote(order)))
+		con:execscript(string.format("DROP TABLE temp.%s", s.stage))
+	end
+	-- building the indexes once over all the rows beats maintaining them through each insert.
+	for _,name in ipairs(merge.indexorder) do
+		con:execscript(merge.indexes[name])
+	end
+	con:execscript("COMMIT")
+	con:close()
+	for _,shard in ipairs(shards) do
+		shard_remove(shard.file)
+	end
+end
+
+-- merge the shards of all attached databases. the workers must not have them open.
+local function shard_mergeall(pool)
+	for _,db in ipairs(pool.shards) do
+		local shards = {}
+		for i=1, pool.parallel do
+			local file, url = shard_path(db.url, i)
+			if shard_exists(file) then
+				table.insert(shards, {file=file, url=url})
+			end
+		end
+		if #shards > 0 then
+			shard_merge(db.url, shards, pool.shardorder)
+		end
+	end
+end
+
 ---- Fork pools ----------------------------------------------------------------
 
+-- size of each result ring in bytes
+local RING_SIZE = 1024*1024
+
 -- TODO: consider batching results (and possibly requests?) like serial does.
 
 local function fork_decode(fut, i)
@@ -276,12 +503,31 @@ local function fork_recv(pool, msg)
 		fut[0] = 0
 		pool.error = true
 	end
-	msg.state = 2 -- MSG_DEAD
+	C.m3_mp_message_free(msg)
 	return ok, err
 end
 
+local function fork_consume(pool)
+	local rings, num = pool.rings, pool.ringnum
+	for i=1, #rings do
+		local r = rings[i]
+		while true do
+			local ptr = C.m3_mp_ring_read(r.ring, num)
+			if num[0] == 0 then break end
+			local f = pool.consumers[r.name]
+			if f then f(ffi_cast(r.ptype, ptr), num[0]) end
+			C.m3_mp_ring_release(r.ring, num[0])
+		end
+	end
+end
+
 local function fork_tick(pool)
-	if C.m3_mp_future_completed(pool.read_fut) == 0 then return end
+	-- records are committed before the response is sent, so when the response is in, the
+	-- records of its task are too. check for the response first, and consume the records
+	-- before handling it.
+	local done = C.m3_mp_future_completed(pool.read_fut) ~= 0
+	if pool.rings[1] then fork_consume(pool) end
+	if not done then return end
 	local ok, err = fork_recv(pool, ffi_cast("m3_Message *", pool.read_fut.data))
 	C.m3_mp_queue_read(pool.work2main, pool.read_fut)
 	if not ok then error(err, 0) end
@@ -313,20 +559,74 @@ local function fork_newfuture(pool)
 	return id, fut
 end
 
-local function fork_eval(pool, ...)
+local function fork_send(pool, queue, ...)
 	local id, fut = fork_newfuture(pool)
 	local ptr, len = encodeargs(...)
 	local msg = C.m3_mp_proc_alloc_message(pool.pp, id, len)
 	ffi_copy(msg.data, ptr, len)
-	C.m3_mp_queue_write(pool.main2work, ffi_cast("uintptr_t", msg), pool.write_fut)
+	C.m3_mp_queue_write(queue, ffi_cast("uintptr_t", msg), pool.write_fut)
 	fork_waitwrite(pool)
 	return fut
 end
 
-local function fork_func()
-	-- TODO: this can be supported, but requires direct communication with each worker process,
-	-- which we don't currently have.
-	error("TODO")
+local function fork_eval(pool, ...)
+	return fork_send(pool, pool.main2work, ...)
+end
+
+-- evaluate on worker `i` only.
+-- control messages take priority over queued tasks, but a task that is already running
+-- finishes first.
+local function fork_evalon(pool, i, ...)
+	local queue = pool.ctrl[i]
+	if not queue then
+		error(string.format("no such worker: %s", i))
+	end
+	return fork_send(pool, queue, ...)
+end
+
+-- evaluate on every worker, returns a list of futures indexed by worker.
+local function fork_broadcast(pool, ...)
+	local futs = {}
+	for i=1, pool.parallel do
+		futs[i] = fork_evalon(pool, i, ...)
+	end
+	return futs
+end
+
+local function fork_waitall(pool, futs)
+	for _,fut in ipairs(futs) do
+		while not fut:poll() do
+			fork_tick(pool)
+			if pool.error then error("worker failed", 0) end
+			if fut:poll() then break end
+			C.m3_mp_proc_park(pool.proc)
+		end
+	end
+end
+
+-- every worker gets the same function id because the workers are forked from the same state
+-- and functions are only ever registered on all of them, in the same order.
+local function fork_func(pool, ...)
+	local futs = fork_broadcast(pool, 0, ...)
+	fork_waitall(pool, futs)
+	local id = futs[1][1]
+	for i=2, #futs do
+		if futs[i][1] ~= id then
+			error(string.format("function ids diverged: worker 1 has %s, worker %d has %s",
+				id, i, futs[i][1]))
+		end
+	end
+	return id
+end
+
+local function fork_sqlstats(pool)
+	local futs = fork_broadcast(pool, "return m3.sqlstats()")
+	fork_waitall(pool, futs)
+	local stats = {}
+	for i,fut in ipairs(futs) do
+		stats[i] = fut[1]
+	end
+	return stats
 end
 
 local function fork_close(pool)
@@ -341,6 +641,8 @@ local function fork_close(pool)
 	local pids = pool.pids
 	local npids = pool.parallel
 	local timeout = 10 * 1e6
+	local status = ffi.new("int[1]")
+	local failed = {}
 	while npids > 0 do
 		while true do
 			fork_tick(pool)
@@ -351,11 +653,15 @@ local function fork_close(pool)
 		end
 		local i = 1
 		while i <= npids do
-			local r = C.m3_sys_waitpid(pids[i])
+			local r = C.m3_sys_waitpid(pids[i], status)
 			if r == 0 then
 				-- not exited yet
 				i = i+1
 			else
+				if status[0] ~= 0 then
+					table.insert(failed, string.format("worker %d exited with status %d",
+						pids[i], status[0]))
+				end
 				pids[i] = pids[npids]
 				npids = npids-1
 			end
@@ -363,14 +669,40 @@ local function fork_close(pool)
 	end
 	-- finish any remaining work once more after all children exited.
 	fork_tick(pool)
+	-- the workers have flushed everything, now the writer may finish.
+	if pool.writer then
+		C.m3_mp_event_set(pool.writer_exit, 1)
+		local r
+		repeat
+			r = C.m3_sys_waitpid(pool.writer, status)
+			if r == 0 then C.m3_mp_proc_park_timeout(pool.proc, timeout) end
+		until r ~= 0
+		-- the writer keeps going after an error so that the workers don't block on it, and
+		-- reports it through its exit status.
+		if status[0] ~= 0 then
+			table.insert(failed, string.format(
+				"writer process exited with status %d, output is incomplete", status[0]))
+		end
+	end
 	C.m3_mem_unmap(pool.map, pool.mapsize)
+	-- the workers closed their shards on exit.
+	if pool.shards then
+		shard_mergeall(pool)
+	end
+	if #failed > 0 then
+		error(table.concat(failed, "\n"), 0)
+	end
 end
 
 local fork_mt = {
-	eval  = fork_eval,
-	func  = fork_func,
-	close = fork_close,
-	type = "fork"
+	eval      = fork_eval,
+	evalon    = fork_evalon,
+	broadcast = fork_broadcast,
+	func      = fork_func,
+	sqlstats  = fork_sqlstats,
+	consume   = pool_consume,
+	close     = fork_close,
+	type      = "fork"
 }
 fork_mt.__index = fork_mt
 
@@ -391,13 +723,75 @@ local function fork(f)
 	end
 end
 
-local function fork_new(L,p)
+-- the writer process owns the only write connection to the output database.
+-- workers ship their backlogs to it instead of flushing them, and it commits them in as few
+-- transactions as it can: whenever the backlog is full, and whenever it runs out of input.
+local function fork_writer(L, heap, queue, exit_event)
+	local fid = env_func(L, [[
+local C = require "m3_C"
+local db = require "m3_db"
+local ffi = require "ffi"
+local ffi_cast, xpcall, traceback = ffi.cast, xpcall, debug.traceback
+local heap, queue, exit_event = ...
+_G.M3_WORKER_ID = 0
+
+local queue = ffi.cast("m3_Queue *", queue)
+local exit_event = ffi.cast("m3_Event *", exit_event)
+
+local pp = ffi.new("m3_ProcPrivate")
+pp.heap.cursor = heap
+local proc = ffi.cast("m3_Proc *", C.m3_mp_heap_alloc(pp.heap, ffi.sizeof("m3_Proc")))
+pp.proc = proc
+local read_fut = ffi.cast("m3_Future *", C.m3_mp_heap_alloc(pp.heap, ffi.sizeof("m3_Future")))
+local exit_fut = ffi.cast("m3_Future *", C.m3_mp_heap_alloc(pp.heap, ffi.sizeof("m3_Future")))
+C.m3_mp_queue_read(queue, read_fut)
+C.m3_mp_event_wait(exit_event, 0, exit_fut)
+
+-- after an error, keep consuming messages so that the workers don't block on a full queue.
+-- the error is raised on exit, so that the exit status tells the host the output is incomplete.
+local err
+local function try(f, ...)
+	if err then return end
+	local ok, e = xpcall(f, traceback, ...)
+	if not ok then
+		err = e
+		io.stderr:write("m3 writer: ", e, "\n")
+	end
+end
+
+return function()
+	while true do
+		if C.m3_mp_future_completed(read_fut) ~= 0 then
+			local msg = ffi_cast("m3_Message *", read_fut.data)
+			try(db.decode, msg.data, msg.len)
+			C.m3_mp_message_free(msg)
+			C.m3_mp_queue_read(queue, read_fut)
+		elseif C.m3_mp_future_completed(exit_fut) ~= 0 then
+			break
+		else
+			try(db.flush)
+			C.m3_mp_proc_park(proc)
+		end
+	end
+	if err then error(err, 0) end
+	db.disconnect(true)
+end
+	]],
+		heap,
+		ffi.cast("uintptr_t", queue),
+		ffi.cast("uintptr_t", exit_event)
+	)
+	env_eval(L, fid)
+end
+
+local function fork_new(L, p, opt)
 	-- map from lowest to highest addr
 	--   * shared heap
 	--   * main process heap
 	--   * `environment.parallel` × worker heaps
+	--   * writer process heap
 	-- and one extra region for alignment
-	local mapsize = C.CONFIG_MP_PROC_MEMORY*(p+3)
+	local mapsize = C.CONFIG_MP_PROC_MEMORY*(p+4)
 	local ptr = ffi.new("void *[1]")
 	C.check(C.m3_mem_map_shared(C.err, mapsize, ptr))
 	local map = ptr[0]
@@ -410,9 +804,52 @@ local function fork_new(L,p)
 	-- TODO: make queue size configurable
 	local main2work = C.m3_mp_queue_new(mem.heap, 8*p)
 	local work2main = C.m3_mp_queue_new(mem.heap, 8*p)
+	-- per-worker control queues for evalon/broadcast
+	local ctrl = {}
+	for i=1, p do
+		ctrl[i] = C.m3_mp_queue_new(mem.heap, 8)
+	end
 	local exit_event = ffi.cast("m3_Event *", C.m3_mp_heap_alloc(mem.heap, ffi.sizeof("m3_Event")))
+	local shards
+	if opt.shard then
+		if opt.writer then
+			error("sharded output can't be combined with a writer process")
+		end
+		shards = env_eval(L, "return require('m3_db').attached()")
+	end
+	local image
+	if opt.image then
+		if opt.shard then
+			error("a shared database image can't be combined with sharded output")
+		end
+		image = env_eval(L, "return require('m3_db').image_create()")
+	end
+	local writer_queue, writer_exit
+	if opt.writer then
+		writer_queue = C.m3_mp_queue_new(mem.heap, 4*p)
+		writer_exit = ffi.cast("m3_Event *", C.m3_mp_heap_alloc(mem.heap, ffi.sizeof("m3_Event")))
+	end
+	-- result rings: one per worker and ring definition.
+	-- the main process proc is going to be the first allocation in its heap.
+	local consumer = ffi.cast("m3_Proc *", base + C.CONFIG_MP_PROC_MEMORY)
+	local schema = ringtypes(L)
+	local rings, ringptr = {}, {}
+	for i=1, p do
+		ringptr[i] = {}
+		for _,r in ipairs(schema) do
+			local ring = C.m3_mp_ring_new(mem.heap, consumer, r.stride, math.ceil(RING_SIZE/r.stride))
+			ringptr[i][r.name] = ffi.cast("uintptr_t", ring)
+			table.insert(rings, {name=r.name, ptype=r.ptype, ring=ring})
+		end
+	end
 	env_eval(L, "require('m3_db').disconnect(false)")
 	ffi.gc(L, nil)
+	local writer
+	if opt.writer then
+		writer = fork(function()
+			fork_writer(L, base + (p+2)*C.CONFIG_MP_PROC_MEMORY, writer_queue, writer_exit)
+		end)
+	end
 	local pids = {}
 	for i=1, p do
 		pids[i] = fork(function()
@@ -422,27 +859,55 @@ local function fork_new(L,p)
 local C = require "m3_C"
 local buffer = require "string.buffer"
 local ffi = require "ffi"
+local ring = require "m3_ring"
 local eval, ffi_cast, ffi_copy, xpcall, traceback = m3.eval, ffi.cast, ffi.copy, xpcall, debug.traceback
-local pid, heap, main2work, work2main, exit_event = ...
+local ring_commit, ring_rollback = ring.commit, ring.rollback
+local pid, heap, main2work, work2main, exit_event, rings, ctrl, writer_queue, shard, image = ...
 _G.M3_WORKER_ID = pid
+ring.attach(rings)
+if shard then require("m3_db").shard(pid) end
+if image then require("m3_db").image(image) end
 
 local main2work = ffi.cast("m3_Queue *", main2work)
+local ctrl = ffi.cast("m3_Queue *", ctrl)
 local work2main = ffi.cast("m3_Queue *", work2main)
 local exit_event = ffi.cast("m3_Event *", exit_event)
 
 local pp = ffi.new("m3_ProcPrivate")
 pp.heap.cursor = heap
 local proc = ffi.cast("m3_Proc *", C.m3_mp_heap_alloc(pp.heap, ffi.sizeof("m3_Proc")))
+pp.proc = proc
 local write_fut = ffi.cast("m3_Future *", C.m3_mp_heap_alloc(pp.heap, ffi.sizeof("m3_Future")))
 local read_fut = ffi.cast("m3_Future *", C.m3_mp_heap_alloc(pp.heap, ffi.sizeof("m3_Future")))
+local ctrl_fut = ffi.cast("m3_Future *", C.m3_mp_heap_alloc(pp.heap, ffi.sizeof("m3_Future")))
 local exit_fut = ffi.cast("m3_Future *", C.m3_mp_heap_alloc(pp.heap, ffi.sizeof("m3_Future")))
 C.m3_mp_queue_read(main2work, read_fut)
+C.m3_mp_queue_read(ctrl, ctrl_fut)
 C.m3_mp_event_wait(exit_event, 0, exit_fut)
 write_fut.state = -1ull
 
 local encoder = buffer.new()
 local decoder = buffer.new()
 
+if writer_queue then
+	-- ship the backlog to the writer process instead of writing it ourselves.
+	-- wait until the message is queued so that a slow writer slows us down, too.
+	local db = require "m3_db"
+	local writer_queue = ffi.cast("m3_Queue *", writer_queue)
+	local sink_fut = ffi.cast("m3_Future *", C.m3_mp_heap_alloc(pp.heap, ffi.sizeof("m3_Future")))
+	local sinkbuf = buffer.new()
+	db.sink(function()
+		sinkbuf:reset()
+		db.encode(sinkbuf)
+		local msg = C.m3_mp_proc_alloc_message(pp, 0, #sinkbuf)
+		ffi_copy(msg.data, sinkbuf:ref())
+		C.m3_mp_queue_write(writer_queue, ffi_cast("uintptr_t", msg), sink_fut)
+		while C.m3_mp_future_completed(sink_fut) == 0 do
+			C.m3_mp_proc_park(proc)
+		end
+	end)
+end
+
 local function decode1()
 	if #decoder > 0 then
 		return decoder:decode(), decode1()
@@ -460,23 +925,35 @@ local function encode(...)
 	return encode1(select("#", ...), ...)
 end
 
-local function doeval(msg, ...)
-	msg.state = 2 -- MSG_DEAD
-	C.m3_mp_queue_read(main2work, read_fut)
-	return encode(xpcall(eval, traceback, ...))
+-- publish the records of a successful task, and drop the records of a failed one.
+local function finish(ok, ...)
+	if ok then ring_commit() else ring_rollback() end
+	return encode(ok, ...)
+end
+
+local function doeval(msg, queue, fut, ...)
+	C.m3_mp_message_free(msg)
+	C.m3_mp_queue_read(queue, fut)
+	return finish(xpcall(eval, traceback, ...))
+end
+
+local function serve(queue, fut)
+	local msg = ffi_cast("m3_Message *", fut.data)
+	local chan = msg.chan
+	decoder:set(msg.data, msg.len)
+	encoder:reset()
+	doeval(msg, queue, fut, decode1())
+	local response = C.m3_mp_proc_alloc_message(pp, chan, #encoder)
+	ffi_copy(response.data, encoder:ref())
+	C.m3_mp_queue_write(work2main, ffi_cast("uintptr_t", response), write_fut)
 end
 
 return function()
 	while true do
-		if C.m3_mp_future_completed(write_fut) ~= 0 and C.m3_mp_future_completed(read_fut) ~= 0 then
-			local msg = ffi_cast("m3_Message *", read_fut.data)
-			local chan = msg.chan
-			decoder:set(msg.data, msg.len)
-			encoder:reset()
-			doeval(msg, decode1())
-			local response = C.m3_mp_proc_alloc_message(pp, chan, #encoder)
-			ffi_copy(response.data, encoder:ref())
-			C.m3_mp_queue_write(work2main, ffi_cast("uintptr_t", response), write_fut)
+		if C.m3_mp_future_completed(write_fut) ~= 0 and C.m3_mp_future_completed(ctrl_fut) ~= 0 then
+			serve(ctrl, ctrl_fut)
+		elseif C.m3_mp_future_completed(write_fut) ~= 0 and C.m3_mp_future_completed(read_fut) ~= 0 then
+			serve(main2work, read_fut)
 		elseif C.m3_mp_future_completed(exit_fut) ~= 0 then
 			break
 		else
@@ -490,7 +967,12 @@ end
 			base + (i+1)*C.CONFIG_MP_PROC_MEMORY,
 			ffi.cast("uintptr_t", main2work),
 			ffi.cast("uintptr_t", work2main),
-			ffi.cast("uintptr_t", exit_event)
+			ffi.cast("uintptr_t", exit_event),
+			ringptr[i],
+			ffi.cast("uintptr_t", ctrl[i]),
+			writer_queue and ffi.cast("uintptr_t", writer_queue),
+			shards ~= nil,
+			image
 			)
 			env_eval(L, fid)
 		end)
@@ -502,6 +984,7 @@ end
 	pp.heap.cursor = base + C.CONFIG_MP_PROC_MEMORY
 	-- proc must be the first allocation
 	local proc = ffi.cast("m3_Proc *", C.m3_mp_heap_alloc(pp.heap, ffi.sizeof("m3_Proc")))
+	pp.proc = proc
 	local write_fut = ffi.cast("m3_Future *", C.m3_mp_heap_alloc(pp.heap, ffi.sizeof("m3_Future")))
 	local read_fut = ffi.cast("m3_Future *", C.m3_mp_heap_alloc(pp.heap, ffi.sizeof("m3_Future")))
 	C.m3_mp_queue_read(work2main, read_fut)
@@ -515,8 +998,16 @@ end
 		exit_event = exit_event,
 		main2work  = main2work,
 		work2main  = work2main,
+		ctrl       = ctrl,
 		pids       = pids,
 		parallel   = p,
+		writer     = writer,
+		writer_exit = writer_exit,
+		shards     = shards,
+		shardorder = type(opt.shard) == "string" and opt.shard or nil,
+		rings      = rings,
+		ringnum    = ffi.new("uint32_t[1]"),
+		consumers  = {},
 		pending    = {},
 		freelist   = {},
 		nfree      = 0,
@@ -528,10 +1019,15 @@ local function fork_wait(pool)
 	while true do
 		fork_tick(pool)
 		if pool.nfree >= pool.nfut or pool.error then
-			return
+			break
 		end
 		C.m3_mp_proc_park(pool.proc)
 	end
+	if pool.shards and not pool.error then
+		-- have the workers close their shards, they reopen fresh ones on the next write.
+		fork_waitall(pool, fork_broadcast(pool, "require('m3_db').disconnect(true)"))
+		shard_mergeall(pool)
+	end
 end
 
 ---- Pool management -----------------------------------------------------------
@@ -548,22 +1044,49 @@ local function parseconfig(config)
 			return "fork", C.m3_sys_num_cpus()
 		end
 	elseif type(config) == "table" then
-		local mode = config.mode
-		return mode, mode == "serial" and 0 or (config.parallel or C.m3_sys_num_cpus())
+		local mode, parallel = parseconfig(config.mode)
+		if mode ~= "serial" and config.parallel then
+			parallel = config.parallel
+		end
+		return mode, parallel, config
 	elseif config == false or tonumber(config) == 0 then
 		return "serial"
 	elseif type(config) == "number" or (type(config) == "string" and tonumber(config)) then
-		return C.MODE_DEFAULT, tonumber(config)
+		return (parseconfig()), tonumber(config)
 	elseif type(config) == "string" then
-		local m, p = string.match(config, "^([^,])*,?(.*)$")
+		local m, p = string.match(config, "^([^,]*),?(.*)$")
 		return m, tonumber(p) or C.m3_sys_num_cpus()
 	else
 		error(string.format("expected mode definition: `%s'", config))
 	end
 end
 
+-- run the warmup hook in the host state before forking, so that every worker inherits the
+-- compiled traces instead of recording its own copies.
+-- anything the hook does to work memory, the output database or result rings is thrown away.
+local function warmup(L, hook, ...)
+	env_eval(L, "m3.warmup(true)")
+	local ok, err = xpcall(hook, debug.traceback, L, ...)
+	env_eval(L, "m3.warmup(false)")
+	if not ok then error(err, 0) end
+end
+
+-- config:
+--   nil                        -> default mode and parallelism
+--   false | 0                  -> serial
+--   num                        -> default mode, `num` processes
+--   "mode[,num]"               -> `mode`, `num` processes
+--   { mode=.., parallel=.., warmup=.., writer=.., shard=.., image=.. }
+-- warmup is a function (env, ...) -> (), called with the return values of `init` after the
+-- environment is initialized, but before the workers are forked.
+-- writer=true makes fork pools write all output through a single writer process.
+-- shard=true gives each fork worker its own copy of the attached databases, which are merged
+-- on wait and close. shard="col" merges tables that have the column `col` in its order.
+-- image=true makes fork workers read the main database from one read-only image shared by
+-- all of them, see m3_db.image_create().
 local function newpool(init, config)
-	local mode, parallel = parseconfig(config)
+	local mode, parallel, opt = parseconfig(config)
+	opt = opt or {}
 	local L = newenv()
 	if mode == "serial" then
 		serial_preinit(L)
@@ -572,9 +1095,16 @@ local function newpool(init, config)
 	env_init(L)
 	local pool
 	if mode == "serial" then
+		if opt.warmup then
+			-- nothing to inherit the traces, the tasks warm up the only state anyway.
+			io.stderr:write("m3: warmup has no effect on serial pools, ignoring it\n")
+		end
 		pool = serial_new(L)
 	elseif mode == "fork" then
-		pool = fork_new(L, parallel)
+		if opt.warmup then
+			warmup(L, opt.warmup, unpack(ret, 1, ret.n))
+		end
+		pool = fork_new(L, parallel, opt)
 	end
 	return pool, unpack(ret, 1, ret.n)
 end
@@ -591,11 +1121,17 @@ local function wait(x)
 	end
 end
 
+-- 1 if `path` is a unix socket, 0 if it's anything else, -1 if it doesn't exist.
+local function issocket(path)
+	return C.m3_sys_issocket(path)
+end
+
 --------------------------------------------------------------------------------
 
 return {
-	new     = newenv,
-	pool    = newpool,
-	wait    = wait,
-	version = C.version
+	new      = newenv,
+	pool     = newpool,
+	wait     = wait,
+	issocket = issocket,
+	version  = C.version
 }
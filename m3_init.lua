@@ -1,11 +1,17 @@
+local colfile = require "m3_colfile"
+local data = require "m3_data"
 local db = require "m3_db"
+local colfile_close = colfile.close
 local db_disconnect = db.disconnect
+local profile_save = data.profile_save
 
 _G._m3_shutdown = function()
 	db_disconnect(true)
+	colfile_close()
+	profile_save()
 end
 
-require("m3_data").init()
+data.init()
 
 -- TODO: m3_debug uses require, fix that first
 -- TODO: mp also does this, unload must come later...
@@ -1,8 +1,10 @@
+local colfile      = require "m3_colfile"
 local control      = require "m3_control"
 local data         = require "m3_data"
 local db           = require "m3_db"
 local dbg          = require "m3_debug"
 local mem          = require "m3_mem"
+local ring         = require "m3_ring"
 
 local function worker()
 	return M3_WORKER_ID or 0
@@ -31,17 +33,22 @@ _G.control = {
 
 _G.data = {
 	arg            = data.arg,
+	cachestats     = data.cachestats,
 	cdata          = data.memslot,
 	define         = data.define,
 	defined        = data.defined,
 	func           = data.func,
 	include        = data.include,
+	layout_profile = data.layout_profile,
 	mappers        = data.mappers,
 	ret            = data.ret,
 	splat          = data.splat,
 	transaction    = data.transaction,
 	attach         = db.attach,
+	colfile        = colfile.output,
+	dbconfig       = db.config,
 	ddl            = db.ddl,
+	ring           = ring.ring,
 }
 
 _G.pprint          = dbg.pprint
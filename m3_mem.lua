@@ -48,12 +48,32 @@ local function mem_ofs2mask(ofs, size)
 	return bit.lshift(1ull, last+1) - bit.lshift(1ull, first)
 end
 
-local function mem_save()
+local function savepoint()
 	local fp = C.m3_mem_save(mem)
 	event("save", fp)
 	return fp
 end
 
+-- lazy savepoints are for branching in control programs: lsave() doesn't save anything until
+-- the next write, so branches that only read don't pay for saving and loading.
+-- lazy_fp[i] is the savepoint of lazy savepoint i, or false if it's still pending.
+-- pending lazy savepoints are lazy_first...lazy_top.
+local lazy_fp = { [0]=false }
+local lazy_top = 0
+local lazy_first = 1
+
+local function lazy_realize()
+	for i=lazy_first, lazy_top do
+		lazy_fp[i] = savepoint()
+	end
+	lazy_first = lazy_top+1
+end
+
+local function mem_save()
+	if lazy_first <= lazy_top then lazy_realize() end
+	return savepoint()
+end
+
 local function mem_load(fp)
 	event("load", fp)
 	C.m3_mem_load(mem, fp)
@@ -129,6 +149,7 @@ local function mem_delete(fp)
 end
 
 local function mem_write(mask)
+	if lazy_first <= lazy_top then lazy_realize() end
 	mem.diff = bor(mem.diff, mask)
 	-- print("mem_write", mask, mem.unsaved, band(mem.unsaved, mask))
 	if band(mem.unsaved, mask) ~= 0 then
@@ -137,6 +158,26 @@ local function mem_write(mask)
 	end
 end
 
+local function mem_lsave()
+	lazy_top = lazy_top+1
+	lazy_fp[lazy_top] = false
+	return lazy_top
+end
+
+-- nothing to do if nothing was written since lsave().
+local function mem_lload(lp)
+	local fp = lazy_fp[lp]
+	if fp then mem_load(fp) end
+end
+
+-- lazy savepoints must be deleted in reverse order.
+local function mem_ldelete(lp)
+	local fp = lazy_fp[lp]
+	if fp then mem_delete(fp) end
+	lazy_top = lp-1
+	lazy_first = math.min(lazy_first, lp)
+end
+
 local function mem_iswritable(ptr)
 	return cast(uintptr_t, ptr) - cast(uintptr_t, mem.framealloc.chunk) < mem.framealloc.chunktop
 end
@@ -166,6 +207,28 @@ local function mem_alloc(size, align)
 	return alloc(mem.alloc, size, align)
 end
 
+-- allocate from the pending frame. the memory is reclaimed when the pending frame is reset by
+-- load(), or when the frame it belongs to after save() is deleted.
+local function mem_framealloc(size, align)
+	return alloc(mem.framealloc, size, align)
+end
+
+-- allocators for memory with a lifetime of its own. everything allocated from one is freed at
+-- once by mem.reset(). the allocator itself lives as long as mem.
+local function mem_newalloc()
+	local ap = cast("m3_Alloc *", mem_alloc(ffi.sizeof("m3_Alloc"), ffi.alignof("m3_Alloc")))
+	ffi.fill(ap, ffi.sizeof("m3_Alloc"))
+	return ap
+end
+
+local function mem_allocfrom(ap, size, align)
+	return alloc(ap, size, align)
+end
+
+local function mem_reset(ap)
+	C.m3_mem_reset(ap)
+end
+
 local function mem_realloc(oldptr, oldsize, newsize, align)
 	return realloc(mem.alloc, oldptr, oldsize, newsize, align)
 end
@@ -203,8 +266,15 @@ return {
 	load            = mem_load,
 	delete          = mem_delete,
 	write           = mem_write,
+	lsave           = mem_lsave,
+	lload           = mem_lload,
+	ldelete         = mem_ldelete,
 	iswritable      = mem_iswritable,
 	alloc           = mem_alloc,
+	framealloc      = mem_framealloc,
+	newalloc        = mem_newalloc,
+	allocfrom       = mem_allocfrom,
+	reset           = mem_reset,
 	realloc         = mem_realloc,
 	objref          = mem_objref,
 	getobj          = mem_getobj
@@ -0,0 +1,125 @@
+local C = require "m3_C"
+local ffi = require "ffi"
+local cast, ffi_copy = ffi.cast, ffi.copy
+
+-- result rings carry fixed-size records from the workers to the main process without going
+-- through the message encoder.
+-- in a fork worker, each ring is attached to a shared memory ring that the main process reads
+-- directly. everywhere else records are buffered locally until the host drains them.
+-- records are written immediately, like any other side effect of a lua function, so restoring
+-- a savepoint (eg. in the branches of control.any) doesn't take them back. only a failed task
+-- drops its records, and only those that are not yet published: a task that writes more than
+-- a ring holds publishes early when the ring fills up.
+
+local rings = {} -- name -> writer
+local order = {} -- definition order
+
+local function writer_grow(w)
+	local cap = math.max(2*w.cap, 64)
+	local buf = ffi.new(w.vla, cap)
+	if w.num > 0 then
+		ffi_copy(buf, w.buf, w.num*w.stride)
+	end
+	w.buf = buf
+	w.cap = cap
+end
+
+-- returns a pointer to a new record. the record is published when the task finishes.
+local function writer_alloc(w)
+	if w.ring then
+		return cast(w.ptype, C.m3_mp_ring_alloc(w.ring))
+	end
+	local num = w.num
+	if num >= w.cap then
+		writer_grow(w)
+	end
+	w.num = num+1
+	return w.buf+num
+end
+
+local function writer_write(w, row)
+	w:alloc()[0] = row
+end
+
+local writer_mt = {
+	alloc = writer_alloc,
+	write = writer_write
+}
+writer_mt.__index = writer_mt
+
+-- ring(name, "struct { ... }") -> writer
+local function ring(name, decl)
+	if rings[name] then
+		if rings[name].decl ~= decl then
+			error(string.format("ring `%s' redefined with a different schema", name))
+		end
+		return rings[name]
+	end
+	local ctype = ffi.typeof(decl)
+	local w = setmetatable({
+		name   = name,
+		decl   = decl,
+		stride = ffi.sizeof(ctype),
+		ptype  = ffi.typeof("$ *", ctype),
+		vla    = ffi.typeof("$[?]", ctype),
+		num    = 0,
+		cap    = 0
+	}, writer_mt)
+	rings[name] = w
+	table.insert(order, w)
+	return w
+end
+
+-- schema() -> {{name=..., decl=..., stride=...}, ...}
+local function schema()
+	local out = {}
+	for _,w in ipairs(order) do
+		table.insert(out, {name=w.name, decl=w.decl, stride=w.stride})
+	end
+	return out
+end
+
+-- attach shared memory rings, {name -> m3_Ring *}
+local function attach(ptrs)
+	for name,ptr in pairs(ptrs) do
+		rings[name].ring = cast("m3_Ring *", ptr)
+	end
+end
+
+-- publish records written by the current task.
+local function commit()
+	for i=1, #order do
+		local r = order[i].ring
+		if r then C.m3_mp_ring_commit(r) end
+	end
+end
+
+-- drop records written since the last commit.
+-- without a shared ring, this drops everything written since the last drain.
+local function rollback()
+	for i=1, #order do
+		local w = order[i]
+		if w.ring then
+			C.m3_mp_ring_rollback(w.ring)
+		else
+			w.num = 0
+		end
+	end
+end
+
+-- take the locally buffered records. the pointer is valid until the next write.
+local function drain(name)
+	local w = rings[name]
+	local num = w.num
+	w.num = 0
+	return cast("uintptr_t", w.buf), num
+end
+
+return {
+	ring     = ring,
+	schema   = schema,
+	attach   = attach,
+	commit   = commit,
+	rollback = rollback,
+	drain    = drain
+}
@@ -0,0 +1,107 @@
+local C = require "m3_C"
+local ffi = require "ffi"
+local buffer = require "string.buffer"
+local cast = ffi.cast
+
+-- input snapshots hold autoselect input tables in a columnar layout, sorted by task key, so
+-- that every worker can map the same file read-only and copy a task's rows without going
+-- through sqlite.
+--
+-- file layout:
+--   [0]            "m3snap01"
+--   [8]            uint64 header offset
+--   [16]           uint64 header length
+--   [64...]        data sections, each aligned to 64 bytes
+--   [header ofs]   header (string.buffer encoded)
+-- header:
+--   { tables = { [sql] = { nkey=..., nrow=..., keys=ofs, index=ofs, cols={ {ctype=..., ofs=...}, ... },
+--                          source=... } } }
+-- source identifies the database table the snapshot was written from, its contents are up to
+-- the writer.
+-- for each table:
+--   keys:          double[nkey], ascending
+--   index:         uint32_t[nkey+1], rows of keys[i] are index[i] ... index[i+1]-1
+--   cols[j]:       ctype[nrow]
+
+local MAGIC = "m3snap01"
+local ALIGN = 64
+
+local function pad(fp, ofs)
+	local n = (ALIGN - ofs%ALIGN) % ALIGN
+	if n > 0 then fp:write(string.rep("\0", n)) end
+	return ofs+n
+end
+
+-- write(path, tables)
+-- tables: { [sql] = { nkey=..., nrow=..., keys=ptr, index=ptr, cols={ {ctype=..., data=ptr}, ... },
+--                     source=... } }
+local function write(path, tables)
+	local fp = assert(io.open(path, "wb"))
+	fp:write(string.rep("\0", ALIGN))
+	local ofs = ALIGN
+	local function section(ptr, size)
+		local start = ofs
+		fp:write(ffi.string(ptr, size))
+		ofs = pad(fp, ofs+size)
+		return start
+	end
+	local header = {}
+	for sql,t in pairs(tables) do
+		local h = {
+			nkey  = t.nkey,
+			nrow  = t.nrow,
+			keys  = section(t.keys, t.nkey*ffi.sizeof("double")),
+			index = section(t.index, (t.nkey+1)*ffi.sizeof("uint32_t")),
+			cols  = {},
+			source = t.source
+		}
+		for j,c in ipairs(t.cols) do
+			h.cols[j] = {
+				ctype = tostring(c.ctype),
+				ofs   = section(c.data, t.nrow*ffi.sizeof(c.ctype))
+			}
+		end
+		header[sql] = h
+	end
+	local hdr = buffer.encode({tables=header})
+	fp:write(hdr)
+	fp:seek("set", 0)
+	fp:write(MAGIC, ffi.string(ffi.new("uint64_t[2]", ofs, #hdr), 16))
+	fp:close()
+end
+
+-- open(path) -> { [sql] = { nkey=..., nrow=..., keys=double *, index=uint32_t *, cols={ {ctype=..., data=void *}, ... },
+--                          source=... } }
+-- the mapping is never unmapped.
+local function open(path)
+	local map = ffi.new("void *[1]")
+	local size = ffi.new("size_t[1]")
+	C.check(C.m3_mem_map_file(C.err, path, map, size))
+	local base = cast("uint8_t *", map[0])
+	if size[0] < ALIGN or ffi.string(base, #MAGIC) ~= MAGIC then
+		error(string.format("not an input snapshot: `%s'", path))
+	end
+	local hdr = cast("uint64_t *", base+#MAGIC)
+	local header = buffer.decode(ffi.string(base+tonumber(hdr[0]), tonumber(hdr[1])))
+	local tables = {}
+	for sql,h in pairs(header.tables) do
+		local t = {
+			nkey  = h.nkey,
+			nrow  = h.nrow,
+			keys  = cast("double *", base+h.keys),
+			index = cast("uint32_t *", base+h.index),
+			cols  = {},
+			source = h.source
+		}
+		for j,c in ipairs(h.cols) do
+			t.cols[j] = { ctype=c.ctype, data=base+c.ofs }
+		end
+		tables[sql] = t
+	end
+	return tables
+end
+
+return {
+	write = write,
+	open  = open
+}
@@ -18,7 +18,10 @@ typedef struct ChunkMetadata {
 
 #if M3_MMAP
 
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 static int mem_mmap(m3_Err *err, void **map, size_t size, int flags)
 {
@@ -42,6 +45,26 @@ CFUNC void m3_mem_unmap(void *base, size_t size)
 	munmap(base, size);
 }
 
+// map a whole file read-only. the pages are shared with every other process mapping it.
+CFUNC int m3_mem_map_file(m3_Err *err, const char *path, void **map, size_t *size)
+{
+	int fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return m3_err_sys(err, M3_ERR_OPEN);
+	struct stat st;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return m3_err_sys(err, M3_ERR_OPEN);
+	}
+	void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return m3_err_sys(err, M3_ERR_MMAP);
+	*map = p;
+	*size = st.st_size;
+	return 0;
+}
+
 static int mem_chunk_map(m3_Err *err, void **base, size_t size)
 {
 	return mem_mmap(err, base, size, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE);
@@ -137,6 +160,14 @@ static void mem_alloc_sweep(m3_Alloc *alloc)
 	}
 }
 
+// free everything allocated from `alloc`.
+CFUNC void m3_mem_reset(m3_Alloc *alloc)
+{
+	alloc->cursor = alloc->chunktop;
+	if (UNLIKELY(alloc->needsweep))
+		mem_alloc_sweep(alloc);
+}
+
 static void mem_alloc_destroy(m3_Alloc *alloc)
 {
 	mem_alloc_sweep(alloc);
@@ -229,9 +260,7 @@ CFUNC int m3_mem_save(m3_Mem *mem)
 	mem->parent = id;
 	mem->diff = 0;
 	mem->unsaved = ~0ULL;
-	alloc->cursor = alloc->chunktop;
-	if (UNLIKELY(alloc->needsweep))
-		mem_alloc_sweep(alloc);
+	m3_mem_reset(alloc);
 	return id;
 }
 
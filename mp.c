@@ -65,15 +65,11 @@ CDEF typedef struct m3_Shared {
 	m3_Heap heap;
 } m3_Shared;
 
-#define MSG_FREE 0
-#define MSG_REF  1
-#define MSG_DEAD 2
-
-// `state` must be first, because when this block is in the freelist, we have
-// state=MSG_FREE automatically due to alignment.
+// when the message is on its owner's remote free stack, the first word of `data` links to the
+// next message. the header is left intact because the owner needs `cls` to free it.
 CDEF typedef struct m3_Message {
-	uint8_t state;
 	uint8_t cls;
+	uint8_t _pad;
 	uint16_t chan;
 	uint32_t len;
 	uint8_t data[];
@@ -81,12 +77,12 @@ CDEF typedef struct m3_Message {
 
 CDEF typedef struct m3_Proc {
 	m3_Futex park;
+	uintptr_t rfree;  // messages freed by other processes (MPSC stack)
 } m3_Proc;
 
 CDEF typedef struct m3_ProcPrivate {
 	m3_Heap heap;     // this proc's shared memory heap
-	m3_Message **msg; // all messages ever allocated by this proc
-	uint32_t nmsg, sizemsg;
+	m3_Proc *proc;    // this proc, the first allocation in `heap`
 } m3_ProcPrivate;
 
 /* ---- Shared memory layout ------------------------------------------------ */
@@ -302,21 +298,35 @@ CFUNC void *m3_mp_heap_alloc(m3_Heap *heap, size_t size)
 
 /* ---- Message management -------------------------------------------------- */
 
-static void mp_proc_sweep(m3_ProcPrivate *pp)
+// messages are freed by the receiver, which is usually not the process that allocated them.
+// the receiver pushes the message on the owner's remote free stack, and the owner takes the
+// whole stack at once when a size class runs empty.
+// there is no ABA problem here because the owner never pops single entries.
+
+#define mp_message_next(msg) (*(uintptr_t *) (msg)->data)
+
+CFUNC void m3_mp_message_free(m3_Message *msg)
 {
-	m3_Message **messages = pp->msg;
-	size_t nmes = pp->nmsg;
-	size_t i = 0;
-	while (i < nmes) {
-		m3_Message *mes = messages[i];
-		if (mes->state == MSG_DEAD) {
-			mp_heap_free_cls(&pp->heap, (uintptr_t) mes, mes->cls);
-			messages[i] = messages[--nmes];
-		} else {
-			i++;
-		}
+	m3_Proc *owner = mp_owner(msg);
+	uintptr_t head = __atomic_load_n(&owner->rfree, __ATOMIC_RELAXED);
+	do {
+		mp_message_next(msg) = head;
+	} while (!__atomic_compare_exchange_n(&owner->rfree, &head, (uintptr_t) msg, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// returns nonzero if anything was freed.
+static int mp_proc_drain(m3_ProcPrivate *pp)
+{
+	m3_Proc *proc = pp->proc;
+	uintptr_t ptr = __atomic_exchange_n(&proc->rfree, 0, __ATOMIC_ACQUIRE);
+	if (!ptr) return 0;
+	while (ptr) {
+		m3_Message *msg = (m3_Message *) ptr;
+		ptr = mp_message_next(msg);
+		mp_heap_free_cls(&pp->heap, (uintptr_t) msg, msg->cls);
 	}
-	pp->nmsg = i;
+	return 1;
 }
 
 CFUNC m3_Message *m3_mp_proc_alloc_message(m3_ProcPrivate *pp, uint16_t chan, size_t size)
@@ -325,15 +335,11 @@ CFUNC m3_Message *m3_mp_proc_alloc_message(m3_ProcPrivate *pp, uint16_t chan, si
 	size += sizeof(m3_Message);
 	m3_Message *msg = mp_heap_get_free(&pp->heap, &size);
 	if (UNLIKELY(!msg)) {
-		mp_proc_sweep(pp);
-		msg = mp_heap_get_free_cls(&pp->heap, size);
+		if (mp_proc_drain(pp))
+			msg = mp_heap_get_free_cls(&pp->heap, size);
 		if (UNLIKELY(!msg))
 			msg = mp_heap_bump_cls(&pp->heap, size);
 	}
-	if (UNLIKELY(pp->nmsg >= pp->sizemsg))
-		m3_mem_growvec(pp->msg, pp->sizemsg, 0);
-	pp->msg[pp->nmsg++] = msg;
-	msg->state = MSG_REF;
 	msg->len = len;
 	msg->cls = size;
 	msg->chan = chan;
@@ -646,4 +652,101 @@ again:
 	}
 }
 
+/* ---- Rings --------------------------------------------------------------- */
+
+// single-producer single-consumer ring of fixed-size records.
+// the producer reserves records one at a time and publishes them in batches with commit(),
+// the consumer reads contiguous runs of published records and releases them.
+struct m3_Ring {
+	struct {
+		uint64_t head;         // next record to read
+		m3_Futex wait;         // is the producer waiting for space?
+	} __attribute__((aligned(M3_CACHELINE_SIZE)));
+	struct {
+		uint64_t tail;         // published records
+		uint64_t reserve;      // reserved records (producer only)
+	} __attribute__((aligned(M3_CACHELINE_SIZE)));
+	m3_Proc *consumer;
+	uint32_t mask;             // ring size - 1
+	uint32_t stride;           // record size
+	uint8_t data[] __attribute__((aligned(M3_CACHELINE_SIZE)));
+};
+
+CDEF typedef struct m3_Ring m3_Ring;
+
+CFUNC m3_Ring *m3_mp_ring_new(m3_Heap *heap, m3_Proc *consumer, size_t stride, size_t num)
+{
+	if (num & (num-1))
+		num = 1ULL << (64 - __builtin_clzll(num));
+	size_t size = sizeof(m3_Ring) + num*stride;
+	size = (size + mp_clssize(0) - 1) & -mp_clssize(0);
+	m3_Ring *ring = mp_heap_bump(heap, size);
+	ring->head = 0;
+	ring->wait = 0;
+	ring->tail = 0;
+	ring->reserve = 0;
+	ring->consumer = consumer;
+	ring->mask = num-1;
+	ring->stride = stride;
+	return ring;
+}
+
+CFUNC void m3_mp_ring_commit(m3_Ring *ring)
+{
+	__atomic_store_n(&ring->tail, ring->reserve, __ATOMIC_RELEASE);
+}
+
+// drop the records reserved since the last commit.
+CFUNC void m3_mp_ring_rollback(m3_Ring *ring)
+{
+	ring->reserve = ring->tail;
+}
+
+// the ring is full: publish everything so that the consumer can make progress, wake it up,
+// and sleep until it has released something.
+NOINLINE static void mp_ring_wait(m3_Ring *ring)
+{
+	uint64_t reserve = ring->reserve;
+	m3_mp_ring_commit(ring);
+	for (;;) {
+		__atomic_store_n(&ring->wait, 1, __ATOMIC_SEQ_CST);
+		if (reserve - __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) <= ring->mask) {
+			ring->wait = 0;
+			return;
+		}
+		mp_proc_unpark(ring->consumer);
+		mp_futex_wait(&ring->wait, 1, NULL);
+	}
+}
+
+CFUNC void *m3_mp_ring_alloc(m3_Ring *ring)
+{
+	uint64_t reserve = ring->reserve;
+	if (UNLIKELY(reserve - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) > ring->mask))
+		mp_ring_wait(ring);
+	ring->reserve = reserve+1;
+	return ring->data + (reserve & ring->mask)*ring->stride;
+}
+
+// returns a pointer to the first unread record and stores the number of contiguous readable
+// records in `num`.
+CFUNC void *m3_mp_ring_read(m3_Ring *ring, uint32_t *num)
+{
+	uint64_t head = ring->head;
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	uint64_t idx = head & ring->mask;
+	uint64_t n = tail - head;
+	if (n > ring->mask+1-idx)
+		n = ring->mask+1-idx;
+	*num = n;
+	return ring->data + idx*ring->stride;
+}
+
+CFUNC void m3_mp_ring_release(m3_Ring *ring, uint32_t num)
+{
+	__atomic_store_n(&ring->head, ring->head+num, __ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&ring->wait, 0, __ATOMIC_SEQ_CST))
+		mp_futex_wake1(&ring->wait);
+}
+
 #endif
@@ -0,0 +1,480 @@
+#include "def.h"
+#include "err.h"
+#include "sql.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// sqlite3.h is not included in the amalgamation, these must match it.
+#define SQL_ROW      100
+#define SQL_DONE     101
+#define SQL_STATIC   ((void(*)(void *))0)
+#define SQL_OK       0
+#define SQL_NULL     5
+#define SQL_READONLY 8
+#define SQL_NOTFOUND 12
+#define SQL_IOERR_SHORT_READ  (10 | (2<<8))
+#define SQL_OPEN_READONLY     0x00000001
+#define SQL_OPEN_MAIN_DB      0x00000100
+#define SQL_ACCESS_READWRITE  1
+#define SQL_IOCAP_IMMUTABLE   0x00002000
+
+// value tags. the upper bits of a text tag hold the length.
+CDEF enum {
+	M3_SQL_NULL    = 0,
+	M3_SQL_DOUBLE  = 1,
+	M3_SQL_INT     = 2,
+	M3_SQL_TEXT    = 3,
+	M3_SQL_TAGMASK = 3
+};
+
+CDEF typedef union m3_SqlCell {
+	double f;
+	int64_t i;
+	const char *p;
+} m3_SqlCell;
+
+// statement entry. its values start at `base`:
+//   [base+i]                    i'th bind value (i=0,...,narg-1)
+//   [base+narg+k]               parameter index of k'th vector column (in cell.i)
+//   [base+narg+nvcol*(j+1)+k]   value of k'th vector column on j'th extra row
+CDEF typedef struct m3_SqlEntry {
+	sqlite3_stmt *stmt;
+	uint32_t base;
+	uint16_t narg;
+	uint16_t nvcol;
+	uint32_t nrow;
+} m3_SqlEntry;
+
+// keep in sync with m3_db.lua
+CDEF typedef struct m3_SqlBacklog {
+	m3_SqlEntry *entry;
+	uint32_t *tag;
+	m3_SqlCell *cell;
+	uint32_t nentry;
+	uint32_t nvalue;
+	uint32_t rows;   // number of statement executions
+	uint32_t text;   // total length of text values
+	uint32_t fail;
+} m3_SqlBacklog;
+
+static int sql_bind(sqlite3_stmt *stmt, int idx, uint32_t tag, m3_SqlCell cell)
+{
+	switch (tag & M3_SQL_TAGMASK) {
+		case M3_SQL_DOUBLE: return sqlite3_bind_double(stmt, idx, cell.f);
+		case M3_SQL_INT:    return sqlite3_bind_int64(stmt, idx, cell.i);
+		case M3_SQL_TEXT:   return sqlite3_bind_text(stmt, idx, cell.p, tag >> 2, SQL_STATIC);
+		default:            return sqlite3_bind_null(stmt, idx);
+	}
+}
+
+static int sql_step(sqlite3_stmt *stmt)
+{
+	int r = sqlite3_step(stmt);
+	if (LIKELY(r == SQL_DONE || r == SQL_ROW)) {
+		sqlite3_reset(stmt);
+		return 0;
+	}
+	sqlite3_reset(stmt);
+	return r;
+}
+
+static int sql_exec(m3_SqlEntry *e, uint32_t *tag, m3_SqlCell *cell)
+{
+	sqlite3_stmt *stmt = e->stmt;
+	uint32_t base = e->base;
+	int r;
+	for (uint32_t i=0; i<e->narg; i++) {
+		if (UNLIKELY((r = sql_bind(stmt, i+1, tag[base+i], cell[base+i]))))
+			return r;
+	}
+	if (UNLIKELY((r = sql_step(stmt))))
+		return r;
+	uint32_t nvcol = e->nvcol;
+	if (!nvcol)
+		return 0;
+	m3_SqlCell *param = cell + base + e->narg;
+	uint32_t v = base + e->narg + nvcol;
+	for (uint32_t j=0; j<e->nrow; j++, v+=nvcol) {
+		for (uint32_t k=0; k<nvcol; k++) {
+			if (UNLIKELY((r = sql_bind(stmt, param[k].i, tag[v+k], cell[v+k]))))
+				return r;
+		}
+		if (UNLIKELY((r = sql_step(stmt))))
+			return r;
+	}
+	return 0;
+}
+
+// bind and step every statement in the backlog, in order.
+// on error returns the sqlite error code and stores the index of the failing entry in `fail`.
+// the caller is responsible for the transaction and for clearing the backlog.
+CFUNC int m3_sql_flush(m3_SqlBacklog *backlog)
+{
+	m3_SqlEntry *entry = backlog->entry;
+	uint32_t *tag = backlog->tag;
+	m3_SqlCell *cell = backlog->cell;
+	uint32_t n = backlog->nentry;
+	for (uint32_t i=0; i<n; i++) {
+		int r = sql_exec(&entry[i], tag, cell);
+		if (UNLIKELY(r)) {
+			backlog->fail = i;
+			return r;
+		}
+	}
+	return 0;
+}
+
+/* ---- Row extraction ------------------------------------------------------ */
+
+CDEF enum {
+	M3_SQL_F64, M3_SQL_F32,
+	M3_SQL_I64, M3_SQL_I32, M3_SQL_I16, M3_SQL_I8,
+	M3_SQL_U64, M3_SQL_U32, M3_SQL_U16, M3_SQL_U8
+};
+
+// destination of a result column. NULLs are stored as `dummy` if `null` is set, and as zero
+// otherwise.
+CDEF typedef struct m3_SqlColumn {
+	void *ptr;
+	double dummy;
+	uint8_t kind;
+	uint8_t null;
+} m3_SqlColumn;
+
+static void sql_store(sqlite3_stmt *stmt, int i, m3_SqlColumn *col, uint32_t idx)
+{
+	if (col->null && sqlite3_column_type(stmt, i) == SQL_NULL) {
+		double v = col->dummy;
+		switch (col->kind) {
+			case M3_SQL_F64: ((double *) col->ptr)[idx] = v; break;
+			case M3_SQL_F32: ((float *) col->ptr)[idx] = v; break;
+			case M3_SQL_I64: ((int64_t *) col->ptr)[idx] = v; break;
+			case M3_SQL_I32: ((int32_t *) col->ptr)[idx] = v; break;
+			case M3_SQL_I16: ((int16_t *) col->ptr)[idx] = v; break;
+			case M3_SQL_I8:  ((int8_t *) col->ptr)[idx] = v; break;
+			case M3_SQL_U64: ((uint64_t *) col->ptr)[idx] = v; break;
+			case M3_SQL_U32: ((uint32_t *) col->ptr)[idx] = v; break;
+			case M3_SQL_U16: ((uint16_t *) col->ptr)[idx] = v; break;
+			case M3_SQL_U8:  ((uint8_t *) col->ptr)[idx] = v; break;
+		}
+		return;
+	}
+	switch (col->kind) {
+		case M3_SQL_F64: ((double *) col->ptr)[idx] = sqlite3_column_double(stmt, i); break;
+		case M3_SQL_F32: ((float *) col->ptr)[idx] = sqlite3_column_double(stmt, i); break;
+		case M3_SQL_I64: ((int64_t *) col->ptr)[idx] = sqlite3_column_int64(stmt, i); break;
+		case M3_SQL_I32: ((int32_t *) col->ptr)[idx] = sqlite3_column_int64(stmt, i); break;
+		case M3_SQL_I16: ((int16_t *) col->ptr)[idx] = sqlite3_column_int64(stmt, i); break;
+		case M3_SQL_I8:  ((int8_t *) col->ptr)[idx] = sqlite3_column_int64(stmt, i); break;
+		case M3_SQL_U64: ((uint64_t *) col->ptr)[idx] = sqlite3_column_int64(stmt, i); break;
+		case M3_SQL_U32: ((uint32_t *) col->ptr)[idx] = sqlite3_column_int64(stmt, i); break;
+		case M3_SQL_U16: ((uint16_t *) col->ptr)[idx] = sqlite3_column_int64(stmt, i); break;
+		case M3_SQL_U8:  ((uint8_t *) col->ptr)[idx] = sqlite3_column_int64(stmt, i); break;
+	}
+}
+
+// step `stmt` up to `num` times, and store column i of the j'th row in cols[i].ptr[idx+j].
+// returns the number of rows read, or a negative sqlite error code.
+// fewer than `num` rows means the statement is done; the caller must then reset it before
+// stepping it again.
+CFUNC int64_t m3_sql_rows(sqlite3_stmt *stmt, m3_SqlColumn *cols, uint32_t ncol, uint32_t idx,
+	uint32_t num)
+{
+	uint32_t j = 0;
+	for (; j<num; j++) {
+		int r = sqlite3_step(stmt);
+		if (r != SQL_ROW) {
+			if (LIKELY(r == SQL_DONE))
+				break;
+			return -r;
+		}
+		for (uint32_t i=0; i<ncol; i++)
+			sql_store(stmt, i, &cols[i], idx+j);
+	}
+	return j;
+}
+
+/* ---- Shared database images ---------------------------------------------- */
+
+// the "m3img" vfs serves read-only database images from memory that the host maps before
+// forking, so that every worker reads the same pages instead of keeping its own copy and page
+// cache. any file that isn't a registered image is passed through to the default vfs.
+// these are the version 3 vfs and io method layouts from sqlite3.h.
+
+typedef struct sqlite3_vfs sqlite3_vfs;
+typedef struct sqlite3_io_methods sqlite3_io_methods;
+
+typedef struct sqlite3_file {
+	const sqlite3_io_methods *pMethods;
+} sqlite3_file;
+
+struct sqlite3_io_methods {
+	int iVersion;
+	int (*xClose)(sqlite3_file *);
+	int (*xRead)(sqlite3_file *, void *, int, int64_t);
+	int (*xWrite)(sqlite3_file *, const void *, int, int64_t);
+	int (*xTruncate)(sqlite3_file *, int64_t);
+	int (*xSync)(sqlite3_file *, int);
+	int (*xFileSize)(sqlite3_file *, int64_t *);
+	int (*xLock)(sqlite3_file *, int);
+	int (*xUnlock)(sqlite3_file *, int);
+	int (*xCheckReservedLock)(sqlite3_file *, int *);
+	int (*xFileControl)(sqlite3_file *, int, void *);
+	int (*xSectorSize)(sqlite3_file *);
+	int (*xDeviceCharacteristics)(sqlite3_file *);
+	int (*xShmMap)(sqlite3_file *, int, int, int, void volatile **);
+	int (*xShmLock)(sqlite3_file *, int, int, int);
+	void (*xShmBarrier)(sqlite3_file *);
+	int (*xShmUnmap)(sqlite3_file *, int);
+	int (*xFetch)(sqlite3_file *, int64_t, int, void **);
+	int (*xUnfetch)(sqlite3_file *, int64_t, void *);
+};
+
+struct sqlite3_vfs {
+	int iVersion;
+	int szOsFile;
+	int mxPathname;
+	sqlite3_vfs *pNext;
+	const char *zName;
+	void *pAppData;
+	int (*xOpen)(sqlite3_vfs *, const char *, sqlite3_file *, int, int *);
+	int (*xDelete)(sqlite3_vfs *, const char *, int);
+	int (*xAccess)(sqlite3_vfs *, const char *, int, int *);
+	int (*xFullPathname)(sqlite3_vfs *, const char *, int, char *);
+	void *(*xDlOpen)(sqlite3_vfs *, const char *);
+	void (*xDlError)(sqlite3_vfs *, int, char *);
+	void (*(*xDlSym)(sqlite3_vfs *, void *, const char *))(void);
+	void (*xDlClose)(sqlite3_vfs *, void *);
+	int (*xRandomness)(sqlite3_vfs *, int, char *);
+	int (*xSleep)(sqlite3_vfs *, int);
+	int (*xCurrentTime)(sqlite3_vfs *, double *);
+	int (*xGetLastError)(sqlite3_vfs *, int, char *);
+	int (*xCurrentTimeInt64)(sqlite3_vfs *, int64_t *);
+	void *xSetSystemCall;
+	void *xGetSystemCall;
+	void *xNextSystemCall;
+};
+
+sqlite3_vfs *sqlite3_vfs_find(const char *);
+int sqlite3_vfs_register(sqlite3_vfs *, int);
+
+#define SQL_IMAGE_MAX    8
+#define SQL_IMAGE_NAME   64
+
+typedef struct SqlImage {
+	const uint8_t *base;
+	int64_t size;
+	char name[SQL_IMAGE_NAME];
+} SqlImage;
+
+typedef struct SqlImageFile {
+	sqlite3_file base;
+	SqlImage *image;
+} SqlImageFile;
+
+static SqlImage sql_images[SQL_IMAGE_MAX];
+static sqlite3_vfs sql_vfs;
+static sqlite3_vfs *sql_vfs_default;
+
+static SqlImage *sql_image_find(const char *name)
+{
+	if (!name)
+		return NULL;
+	for (int i=0; i<SQL_IMAGE_MAX; i++) {
+		if (sql_images[i].base && !strcmp(sql_images[i].name, name))
+			return &sql_images[i];
+	}
+	return NULL;
+}
+
+static int sql_image_close(sqlite3_file *file)
+{
+	(void)file;
+	return SQL_OK;
+}
+
+static int sql_image_read(sqlite3_file *file, void *buf, int amt, int64_t ofs)
+{
+	SqlImage *image = ((SqlImageFile *) file)->image;
+	if (LIKELY(ofs+amt <= image->size)) {
+		memcpy(buf, image->base+ofs, amt);
+		return SQL_OK;
+	}
+	int64_t n = ofs < image->size ? image->size-ofs : 0;
+	if (n > 0)
+		memcpy(buf, image->base+ofs, n);
+	memset((char *) buf + n, 0, amt-n);
+	return SQL_IOERR_SHORT_READ;
+}
+
+static int sql_image_write(sqlite3_file *file, const void *buf, int amt, int64_t ofs)
+{
+	(void)file; (void)buf; (void)amt; (void)ofs;
+	return SQL_READONLY;
+}
+
+static int sql_image_truncate(sqlite3_file *file, int64_t size)
+{
+	(void)file; (void)size;
+	return SQL_READONLY;
+}
+
+static int sql_image_sync(sqlite3_file *file, int flags)
+{
+	(void)file; (void)flags;
+	return SQL_OK;
+}
+
+static int sql_image_size(sqlite3_file *file, int64_t *size)
+{
+	*size = ((SqlImageFile *) file)->image->size;
+	return SQL_OK;
+}
+
+static int sql_image_lock(sqlite3_file *file, int lock)
+{
+	(void)file; (void)lock;
+	return SQL_OK;
+}
+
+static int sql_image_reserved(sqlite3_file *file, int *out)
+{
+	(void)file;
+	*out = 0;
+	return SQL_OK;
+}
+
+static int sql_image_control(sqlite3_file *file, int op, void *arg)
+{
+	(void)file; (void)op; (void)arg;
+	return SQL_NOTFOUND;
+}
+
+static int sql_image_sectorsize(sqlite3_file *file)
+{
+	(void)file;
+	return 0;
+}
+
+static int sql_image_characteristics(sqlite3_file *file)
+{
+	(void)file;
+	return SQL_IOCAP_IMMUTABLE;
+}
+
+// pages are handed out directly from the image when mmap_size is set.
+static int sql_image_fetch(sqlite3_file *file, int64_t ofs, int amt, void **p)
+{
+	SqlImage *image = ((SqlImageFile *) file)->image;
+	*p = ofs+amt <= image->size ? (void *) (image->base+ofs) : NULL;
+	return SQL_OK;
+}
+
+static int sql_image_unfetch(sqlite3_file *file, int64_t ofs, void *p)
+{
+	(void)file; (void)ofs; (void)p;
+	return SQL_OK;
+}
+
+static const sqlite3_io_methods sql_image_methods = {
+	.iVersion               = 3,
+	.xClose                 = sql_image_close,
+	.xRead                  = sql_image_read,
+	.xWrite                 = sql_image_write,
+	.xTruncate              = sql_image_truncate,
+	.xSync                  = sql_image_sync,
+	.xFileSize              = sql_image_size,
+	.xLock                  = sql_image_lock,
+	.xUnlock                = sql_image_lock,
+	.xCheckReservedLock     = sql_image_reserved,
+	.xFileControl           = sql_image_control,
+	.xSectorSize            = sql_image_sectorsize,
+	.xDeviceCharacteristics = sql_image_characteristics,
+	.xFetch                 = sql_image_fetch,
+	.xUnfetch               = sql_image_unfetch
+};
+
+static int sql_vfs_open(sqlite3_vfs *vfs, const char *name, sqlite3_file *file, int flags,
+	int *outflags)
+{
+	(void)vfs;
+	SqlImage *image;
+	if ((flags & SQL_OPEN_MAIN_DB) && (image = sql_image_find(name))) {
+		((SqlImageFile *) file)->image = image;
+		file->pMethods = &sql_image_methods;
+		if (outflags)
+			*outflags = SQL_OPEN_READONLY;
+		return SQL_OK;
+	}
+	return sql_vfs_default->xOpen(sql_vfs_default, name, file, flags, outflags);
+}
+
+static int sql_vfs_access(sqlite3_vfs *vfs, const char *name, int flags, int *out)
+{
+	(void)vfs;
+	if (sql_image_find(name)) {
+		*out = flags != SQL_ACCESS_READWRITE;
+		return SQL_OK;
+	}
+	return sql_vfs_default->xAccess(sql_vfs_default, name, flags, out);
+}
+
+static int sql_vfs_fullpathname(sqlite3_vfs *vfs, const char *name, int n, char *out)
+{
+	(void)vfs;
+	if (sql_image_find(name)) {
+		if ((int) strlen(name) >= n)
+			return SQL_NOTFOUND;
+		strcpy(out, name);
+		return SQL_OK;
+	}
+	return sql_vfs_default->xFullPathname(sql_vfs_default, name, n, out);
+}
+
+// register (or replace) the image `name`. the memory must stay mapped while it's in use.
+// open it with the uri `file:<name>?vfs=m3img&immutable=1`.
+CFUNC int m3_sql_image(m3_Err *err, const char *name, const void *base, int64_t size)
+{
+	if (!sql_vfs_default) {
+		sqlite3_vfs *dflt = sqlite3_vfs_find(NULL);
+		// only copy the part of the default vfs that its version has.
+		// version 1 ends at xGetLastError, version 2 at xCurrentTimeInt64.
+		size_t size;
+		if (!dflt || dflt->iVersion < 1)
+			return m3_err_set(err, M3_ERR_SQLIMAGE);
+		else if (dflt->iVersion == 1)
+			size = offsetof(sqlite3_vfs, xCurrentTimeInt64);
+		else if (dflt->iVersion == 2)
+			size = offsetof(sqlite3_vfs, xSetSystemCall);
+		else
+			size = sizeof(sqlite3_vfs);
+		memset(&sql_vfs, 0, sizeof(sql_vfs));
+		memcpy(&sql_vfs, dflt, size);
+		sql_vfs.iVersion = dflt->iVersion < 3 ? dflt->iVersion : 3;
+		sql_vfs.szOsFile = dflt->szOsFile > (int) sizeof(SqlImageFile)
+			? dflt->szOsFile : (int) sizeof(SqlImageFile);
+		sql_vfs.pNext = NULL;
+		sql_vfs.zName = "m3img";
+		sql_vfs.xOpen = sql_vfs_open;
+		sql_vfs.xAccess = sql_vfs_access;
+		sql_vfs.xFullPathname = sql_vfs_fullpathname;
+		if (sqlite3_vfs_register(&sql_vfs, 0))
+			return m3_err_set(err, M3_ERR_SQLIMAGE);
+		sql_vfs_default = dflt;
+	}
+	if (strlen(name) >= SQL_IMAGE_NAME)
+		return m3_err_set(err, M3_ERR_SQLIMAGE);
+	SqlImage *image = sql_image_find(name);
+	for (int i=0; !image && i<SQL_IMAGE_MAX; i++) {
+		if (!sql_images[i].base)
+			image = &sql_images[i];
+	}
+	if (!image)
+		return m3_err_set(err, M3_ERR_SQLIMAGE);
+	strcpy(image->name, name);
+	image->base = base;
+	image->size = size;
+	return 0;
+}
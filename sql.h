@@ -22,6 +22,7 @@ SQLITE_FUNC int sqlite3_bind_null(sqlite3_stmt *, int);
 SQLITE_FUNC int sqlite3_bind_text(sqlite3_stmt *, int, const char *, int, void(*)(void*));
 SQLITE_FUNC double sqlite3_column_double(sqlite3_stmt *, int);
 SQLITE_FUNC int sqlite3_column_int(sqlite3_stmt *, int);
+SQLITE_FUNC int64_t sqlite3_column_int64(sqlite3_stmt *, int);
 SQLITE_FUNC const char *sqlite3_column_text(sqlite3_stmt *, int);
 SQLITE_FUNC int sqlite3_column_type(sqlite3_stmt *, int);
 SQLITE_FUNC int sqlite3_column_count(sqlite3_stmt *);
@@ -56,6 +57,7 @@ SQLITE_FUNC const char *sqlite3_libversion(void);
 #define SQLITE_OMIT_SHARED_CACHE
 #define SQLITE_USE_ALLOCA
 #define SQLITE_OMIT_AUTOINIT
+#define SQLITE_USE_URI                 1
 
 // we don't need these
 #define SQLITE_OMIT_AUTHORIZATION
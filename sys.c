@@ -15,13 +15,35 @@ CFUNC int m3_sys_num_cpus(void)
 	return GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
 }
 
+CFUNC int64_t m3_sys_time_ns(void)
+{
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (int64_t) ((double) count.QuadPart * (1e9 / (double) freq.QuadPart));
+}
+
+CFUNC int m3_sys_getpid(void)
+{
+	return GetCurrentProcessId();
+}
+
+CFUNC int m3_sys_issocket(const char *path)
+{
+	(void)path;
+	return -1;
+}
+
 #else
 
 #include <signal.h>
 #include <stdlib.h>
 #include <sched.h>
 #include <sys/prctl.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 CFUNC int m3_sys_num_cpus(void)
 {
@@ -32,6 +54,28 @@ CFUNC int m3_sys_num_cpus(void)
 	return CPU_COUNT(&set);
 }
 
+// monotonic clock, for measuring intervals
+CFUNC int64_t m3_sys_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+CFUNC int m3_sys_getpid(void)
+{
+	return getpid();
+}
+
+// 1 if `path` is a unix socket, 0 if it's anything else, -1 if it doesn't exist.
+CFUNC int m3_sys_issocket(const char *path)
+{
+	struct stat st;
+	if (lstat(path, &st))
+		return -1;
+	return S_ISSOCK(st.st_mode);
+}
+
 CFUNC int m3_sys_fork(void)
 {
 	pid_t pid = fork();
@@ -40,9 +84,17 @@ CFUNC int m3_sys_fork(void)
 	return pid;
 }
 
-CFUNC int m3_sys_waitpid(int pid)
+// returns 0 if the child hasn't exited yet. otherwise stores its exit code in `status`, or -1
+// if it was killed by a signal or waitpid failed.
+CFUNC int m3_sys_waitpid(int pid, int *status)
 {
-	return waitpid(pid, NULL, WNOHANG);
+	int s;
+	int r = waitpid(pid, &s, WNOHANG);
+	if (r > 0)
+		*status = WIFEXITED(s) ? WEXITSTATUS(s) : -1;
+	else if (r < 0)
+		*status = -1;
+	return r;
 }
 
 #endif
@@ -0,0 +1,31 @@
+-- vim: ft=lua
+
+data.define [[
+model global y = 2*g
+]]
+
+local slot = data.cdata("double")
+local values = {}
+
+local setg = data.transaction():update("global", {g=data.arg()})
+local incg = data.transaction():update("global", {g="g+1"})
+local sety = data.transaction():set(slot, "y")
+local gety = data.transaction():read(slot)
+
+-- adjacent transactions without arguments or return values are fused, and each transaction
+-- must still see the writes and resets of the previous ones.
+control.simulate = control.all {
+	control.call(setg, 1),
+	incg,
+	sety,
+	function() table.insert(values, gety()) end,
+	incg,
+	incg,
+	sety,
+	incg,
+	function() table.insert(values, gety()) end
+}
+
+test.post(function()
+	assert(values[1] == 4 and values[2] == 8)
+end)
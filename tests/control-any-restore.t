@@ -0,0 +1,36 @@
+-- vim: ft=lua
+
+data.define [[
+model global y = 2*g
+]]
+
+local values = {}
+
+local setg = data.transaction():update("global", {g=data.arg()})
+local incg = data.transaction():update("global", {g="g+1"})
+local gety = data.transaction():read("y")
+
+-- branches that don't write don't take a savepoint, but every branch must still start
+-- from the state before the any.
+control.simulate = control.all {
+	control.call(setg, 1),
+	control.any {
+		gety,
+		incg,
+		control.any {
+			control.all { incg, incg },
+			gety,
+			incg
+		},
+		gety
+	},
+	function() table.insert(values, gety()) end
+}
+
+test.post(function()
+	local expected = {2, 4, 6, 2, 4, 2}
+	assert(#values == #expected)
+	for i,v in ipairs(expected) do
+		assert(values[i] == v)
+	end
+end)
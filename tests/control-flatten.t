@@ -0,0 +1,52 @@
+-- vim: ft=lua
+
+local flatten = require("m3_control").flatten
+
+data.define [[
+model global y = 2*g
+]]
+
+local slot = data.cdata("double")
+local values = {}
+
+local setg = data.transaction():update("global", {g=data.arg()})
+local incg = data.transaction():update("global", {g="g+1"})
+local sety = data.transaction():set(slot, "y")
+local gety = data.transaction():read(slot)
+
+local function run(steps)
+	for i=1, #steps do
+		local r = steps[i]()
+		if r ~= nil then return r end
+	end
+end
+
+-- flatten() is what -k runs: the calls of an `all' chain in order, with adjacent transactions
+-- fused, until one of them returns a value.
+control.simulate = function()
+	local steps = flatten(control.all {
+		control.call(setg, 1),
+		incg,
+		sety,
+		function() table.insert(values, gety()) end,
+		incg,
+		incg,
+		sety,
+		function() table.insert(values, gety()) end
+	})
+	assert(#steps == 5, #steps)
+	assert(run(steps) == nil)
+	assert(values[1] == 4 and values[2] == 8)
+	local after = false
+	steps = flatten(control.all {
+		incg,
+		function() return false end,
+		function() after = true end
+	})
+	assert(run(steps) == false and not after)
+	local bad
+	steps, bad = flatten(control.all { incg, control.any { incg, sety } })
+	assert(steps == nil and bad:match("^any"), bad)
+	steps, bad = flatten(control.all { incg, "g > 0" })
+	assert(steps == nil and bad:match("^check"), bad)
+end
@@ -0,0 +1,21 @@
+-- vim: ft=lua
+
+local colfile = require "m3_colfile"
+
+local fp = io.open("/dev/full", "wb")
+if not fp then
+	io.stderr:write("# skip data-colfile-full.t: no /dev/full\n")
+	return
+end
+fp:close()
+
+-- rows that can't be written must not be dropped silently.
+colfile.output("/dev/full")
+local out = colfile.writer("Out", {"x"})
+
+test.post(function()
+	for i=1, 10 do out(i) end
+	local ok, err = pcall(colfile.close)
+	assert(not ok, "close() succeeded on a full disk")
+	assert(tostring(err):match("No space"), err)
+end)
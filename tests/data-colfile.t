@@ -0,0 +1,34 @@
+-- vim: ft=lua
+
+local colfile = require "m3_colfile"
+local sqlite = require "sqlite"
+
+local path = os.tmpname()
+data.colfile(path)
+
+local out = data.transaction():col_insert("Out",
+	{ task=data.arg(1), x=data.arg(2), n=data.arg(3) },
+	{ task="dict", n="int32_t" }
+)
+
+control.simulate = function()
+	out("a", 1.5, 1)
+	out("b", 2.5, 2)
+	out("a", 3.5, 3)
+	out(nil, 4.5, 4)
+	test.post(function()
+		colfile.close()
+		local t = colfile.read(path).Out
+		assert(t.nrow == 4)
+		local con = sqlite.open(":memory:")
+		colfile.tosqlite(con, path)
+		os.remove(path)
+		local rows = {}
+		for row in con:rows("SELECT task, x, n FROM Out ORDER BY rowid") do
+			local task, x, n = row:unpack()
+			table.insert(rows, string.format("%s:%s:%s", task, x, n))
+		end
+		con:close()
+		assert(table.concat(rows, " ") == "a:1.5:1 b:2.5:2 a:3.5:3 nil:4.5:4", table.concat(rows, " "))
+	end)
+end
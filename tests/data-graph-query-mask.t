@@ -0,0 +1,27 @@
+-- vim: ft=lua
+
+data.define [[
+# hack: the purpose of the query parameter is to prevent the inlining of x and y
+model global x = g + query.dummy
+model global y = h + query.dummy
+]]
+
+local setg = data.transaction():update("global", {g=data.arg()})
+local seth = data.transaction():update("global", {h=data.arg()})
+local getx = data.transaction():read("x"):bind("dummy", 0)
+local gety = data.transaction():read("y"):bind("dummy", 0)
+
+control.simulate = function()
+	setg(1)
+	seth(2)
+	assert(getx() == 1)
+	assert(gety() == 2)
+	seth(3)
+	-- x doesn't depend on h, so this reuses the instance and leaves the reset pending
+	assert(getx() == 1)
+	assert(gety() == 3)
+	setg(4)
+	seth(5)
+	assert(gety() == 5)
+	assert(getx() == 4)
+end
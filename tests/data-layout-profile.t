@@ -0,0 +1,37 @@
+-- vim: ft=lua
+
+local buffer = require "string.buffer"
+local ffi = require "ffi"
+
+local src = debug.getinfo(1, "S").source:gsub("^@", "")
+local path = os.tmpname()
+
+local a = data.cdata("double")
+local b = data.cdata("double")
+
+local seta, linea = data.transaction():set(a, data.arg()), debug.getinfo(1, "l").currentline
+local setb, lineb = data.transaction():set(b, data.arg()), debug.getinfo(1, "l").currentline
+local keya, keyb = string.format("%s:%d", src, linea), string.format("%s:%d", src, lineb)
+
+-- without a profile, `a` would go first. the profile says `setb` runs more often.
+local fp = assert(io.open(path, "wb"))
+fp:write(buffer.encode({[keya]=1, [keyb]=10, ["gone.lua:1"]=5}))
+fp:close()
+data.layout_profile(path)
+
+control.simulate = function()
+	seta(1)
+	setb(2)
+	setb(3)
+end
+
+test.post(function()
+	assert(ffi.cast("intptr_t", b.ptr) < ffi.cast("intptr_t", a.ptr))
+	require("m3_data").profile_save()
+	fp = assert(io.open(path, "rb"))
+	local counts = buffer.decode(fp:read("*a"))
+	fp:close()
+	data.layout_profile(false)
+	os.remove(path)
+	assert(counts[keya] == 2 and counts[keyb] == 12 and counts["gone.lua:1"] == 5)
+end)
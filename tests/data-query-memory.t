@@ -0,0 +1,49 @@
+-- vim: ft=lua
+
+local function rss()
+	local fp = io.open("/proc/self/statm", "r")
+	if not fp then return end
+	local _, resident = fp:read("*n", "*n")
+	fp:close()
+	return resident*4096
+end
+
+if not rss() then
+	io.stderr:write("# skip data-query-memory.t: can't read resident memory from /proc/self/statm\n")
+	return
+end
+
+data.define [[
+table T[N]
+model global y = 2*x
+]]
+
+local setx = data.transaction():update("global", {x=data.arg()})
+local gety = data.transaction():read("y")
+local insert = data.transaction():insert("T", {x=data.arg(1), z=data.arg(2)})
+local setz = data.transaction():update("T", {z="2*x"})
+local getz = data.transaction():read("T.z")
+local put = data.transaction():call(function() end, data.arg(1), data.arg(2))
+local commit = require("m3_data").commit
+
+local function flat(what, f)
+	for _=1, 1000 do f() end
+	local before = rss()
+	for _=1, 1000000 do f() end
+	local after = rss()
+	assert(after-before < 2^20, string.format("%s: rss grew by %d bytes", what, after-before))
+end
+
+-- query results and committed deferred calls must not grow memory with every call.
+control.simulate = function()
+	setx(1)
+	flat("scalar query", function() assert(gety() == 2) end)
+	insert({1, 2, 3}, {0, 0, 0})
+	flat("vector query", setz)
+	local z = getz()
+	assert(z[0] == 2 and z[1] == 4 and z[2] == 6)
+	flat("deferred call", function()
+		put(1, "x")
+		commit()
+	end)
+end
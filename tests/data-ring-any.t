@@ -0,0 +1,27 @@
+-- vim: ft=lua
+
+local ring = require "m3_ring"
+local ffi = require "ffi"
+
+local out = data.ring("out", "struct { double x; }")
+
+-- ring records are not part of work memory: restoring the savepoint of a branch doesn't take
+-- back the records it wrote.
+control.simulate = control.all {
+	control.any {
+		function() out:write({1}) end,
+		function() out:write({2}) end
+	},
+	function() out:write({3}) end
+}
+
+test.post(function()
+	local ptr, num = ring.drain("out")
+	ptr = ffi.cast(out.ptype, ptr)
+	assert(num == 4)
+	assert(ptr[0].x == 1 and ptr[1].x == 3 and ptr[2].x == 2 and ptr[3].x == 3)
+	-- a failed task drops its records.
+	out:write({4})
+	ring.rollback()
+	assert(select(2, ring.drain("out")) == 0)
+end)
@@ -0,0 +1,41 @@
+-- vim: ft=lua
+
+local m3data = require "m3_data"
+local snapshot = require "m3_snapshot"
+
+data.ddl [[
+CREATE TABLE A(id INTEGER PRIMARY KEY);
+INSERT INTO A(id) VALUES (1), (2);
+CREATE TABLE B(a_id INTEGER REFERENCES A(id), x REAL);
+INSERT INTO B(a_id, x) VALUES (1, 10), (NULL, 99), (2, 20), (1, 11);
+]]
+
+data.define [[
+table A
+table B[N]
+]]
+
+data.task = "SELECT id AS A_id FROM A"
+
+local getx = data.transaction():read("B.x")
+
+local sums = {}
+control.simulate = function()
+	local x, sum = getx(), 0
+	for i=0, #x-1 do sum = sum+x[i] end
+	table.insert(sums, sum)
+end
+
+-- rows with a NULL key belong to no task, and are left out of the snapshot.
+test.post(function()
+	assert(#sums == 2 and sums[1] == 21 and sums[2] == 20)
+	local path = os.tmpname()
+	m3data.snapshot_write(path)
+	local _, t = next(snapshot.open(path))
+	assert(t.nkey == 2 and t.nrow == 3)
+	assert(t.keys[0] == 1 and t.keys[1] == 2)
+	assert(t.index[0] == 0 and t.index[1] == 2 and t.index[2] == 3)
+	-- the snapshot matches the database.
+	m3data.snapshot_use(path)
+	os.remove(path)
+end)
@@ -0,0 +1,22 @@
+-- vim: ft=lua
+
+local db = require "m3_db"
+
+data.ddl [[
+CREATE TABLE Out(x REAL, s TEXT);
+]]
+
+control.simulate = function()
+	local insert = db.statement("INSERT INTO Out(x, s) VALUES (?, ?)")
+	insert(1, "a")
+	insert({2, 3}, "b")
+	insert(4, nil)
+	insert({}, "empty")
+	db.flush()
+	local rows = {}
+	for row in db.connection():rows("SELECT x, s FROM Out ORDER BY rowid") do
+		local x, s = row:unpack()
+		table.insert(rows, string.format("%s:%s", x, s))
+	end
+	assert(table.concat(rows, " ") == "1:a 2:b 3:b 4:nil", table.concat(rows, " "))
+end
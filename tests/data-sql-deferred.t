@@ -0,0 +1,43 @@
+-- vim: ft=lua
+
+local db = require "m3_db"
+
+data.ddl [[
+CREATE TABLE Out(x REAL, s TEXT);
+]]
+
+local log = {}
+
+local put = data.transaction():call(function(a, b, c)
+	table.insert(log, string.format("%s/%s/%s", a, b, c))
+end, data.arg(1), data.arg(2), data.arg(3))
+
+local insert = data.transaction():sql("INSERT INTO Out(x, s) VALUES (?, ?)", data.arg(1), data.arg(2))
+
+-- deferred calls run oldest first when the task commits, whatever mix of numbers and strings
+-- they take. restoring the savepoint before a branch drops the calls the previous branch
+-- deferred, including ones after the branch that were already committed.
+control.simulate = control.all {
+	control.call(put, 1, "a", 2),
+	control.call(insert, 1, "a"),
+	control.any {
+		control.all {
+			control.call(put, "b", 3, "c"),
+			control.call(insert, 2, "b")
+		},
+		control.call(put, 4, 5, 6)
+	},
+	control.call(put, "d", "e", 7)
+}
+
+test.post(function()
+	local expected = {"1/a/2", "b/3/c", "d/e/7", "4/5/6", "d/e/7"}
+	assert(table.concat(log, " ") == table.concat(expected, " "), table.concat(log, " "))
+	db.flush()
+	local rows = {}
+	for row in db.connection():rows("SELECT x, s FROM Out ORDER BY rowid") do
+		local x, s = row:unpack()
+		table.insert(rows, string.format("%s:%s", x, s))
+	end
+	assert(table.concat(rows, " ") == "1:a 2:b", table.concat(rows, " "))
+end)
@@ -0,0 +1,5 @@
+-- vim: ft=lua
+
+test.error("cache: expected at least one key")
+
+data.transaction():read("0"):cache({})
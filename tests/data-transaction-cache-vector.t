@@ -0,0 +1,27 @@
+-- vim: ft=lua
+
+data.define [[
+table T[N]
+]]
+
+local insert = data.transaction():insert("T", {x=data.arg()})
+local key = data.cdata("double")
+local setkey = data.transaction():write(key)
+
+-- the vector points into memory that the savepoint reload reclaims, so a hit after the reload
+-- would return a dangling vector. caching it must fail instead.
+local getx = data.transaction()
+	:read("T.x")
+	:cache({key})
+
+test.error("cached transaction .* returns a reference")
+
+control.simulate = function()
+	setkey(1)
+	local sp = control.save()
+	insert({1, 2, 3})
+	assert(getx()[0] == 1)
+	control.load(sp)
+	insert({4, 5, 6})
+	assert(getx()[0] == 4)
+end
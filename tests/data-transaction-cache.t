@@ -0,0 +1,19 @@
+-- vim: ft=lua
+
+local slot = data.cdata("double")
+
+local setslot = data.transaction():write(slot)
+
+local get = data.transaction()
+	:bind("value", slot)
+	:read("2*query.value")
+	:cache({slot})
+
+control.simulate = function()
+	for i=1, 10 do
+		setslot(i%2)
+		assert(get() == 2*(i%2))
+	end
+	local stats = data.cachestats()[1]
+	assert(stats.misses == 2 and stats.hits == 8)
+end